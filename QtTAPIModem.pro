@@ -24,6 +24,7 @@
 
 TEMPLATE = lib
 QT -= gui
+CONFIG += c++17
 DEFINES += QTTAPIMODEM_LIBRARY QT_DEPRECATED_WARNINGS
 
 TARGET = QtTAPIModem
@@ -35,9 +36,11 @@ MOC_DIR = out/generated
 UI_DIR = out/generated
 RCC_DIR = out/generated
 
-SOURCES += qttapimodem.cpp
+SOURCES += qttapimodem.cpp\
+        qttapimodembuffer.cpp
 
 HEADERS += qttapimodem.h\
+        qttapimodembuffer.h\
         qttapimodem_global.h
 
 LIBS += -luser32 -ltapi32
@@ -29,12 +29,14 @@ SOURCES += main.cpp\
         mainwindow.cpp \
     console.cpp \
     settingsdialog.cpp \
-    ../../qttapimodem.cpp
+    ../../qttapimodem.cpp \
+    ../../qttapimodembuffer.cpp
 
 HEADERS  += mainwindow.h \
     console.h \
     settingsdialog.h \
     ../../qttapimodem_global.h \
+    ../../qttapimodembuffer.h \
     ../../qttapimodem.h
 
 
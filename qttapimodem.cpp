@@ -5,20 +5,79 @@
 
 #include "qttapimodem.h"
 
+#include <QDateTime>
+#include <QVarLengthArray>
+#include <QtAlgorithms>
+
+#include <atomic>
+#include <cstring>
+#include <iterator>
+#include <utility>
+
 #if defined(QT_DEBUG) && defined(QTAPI_DEBUG)
 #include <QDebug>
 #endif
 
+/* Smallest amount of data per event that is worth delaying reads for */
+static constexpr qint64 ADAPTIVE_MINIMUM_BATCH = 16;
+/* Largest chunk small writes are gathered into */
+static constexpr qint64 WRITE_BATCH_SIZE = 4096;
+/* Smallest QByteArray that is queued shared instead of copied */
+static constexpr qint64 SHARED_WRITE_MINIMUM = 1024;
+/* Smallest amount of data paced writes wait for */
+static constexpr qint64 PACE_MINIMUM_WRITE = 16;
+/* Number of preallocated write requests, the most writes that can wait in the driver at once */
+static constexpr int WRITE_REQUEST_POOL_SIZE = 16;
+/* Most replies the session keeps for requests that weren't registered yet */
+static constexpr qsizetype UNCLAIMED_REPLY_LIMIT = 64;
+/* How long the pool waits (in miliseconds) before trying lines that couldn't be initialized again */
+static constexpr int POOL_RETRY_INTERVAL = 1000;
+
 TAPIModem::TAPIModem(QObject *parent) : QIODevice(parent)
 {
+    /* With weighted scheduling normal data gets 4 batches for every bulk one */
+    outboundQueues[NormalPriority].weight = 4;
+    outboundQueues[BulkPriority].weight = 1;
 }
 
 TAPIModem::~TAPIModem()
 {
-    if(tapiStateFlag == Uninitialized) return;
+    /* Notifiers and timers are deleted on the thread they live on */
+    auto shutdown = [this]
+    {
+        if(tapiState() != Uninitialized)
+        {
+            /* TAPI is shared with other modems, so our call and line must be closed first */
+            shutdownTAPI();
+        }
 
-    /* We need to deinitialize TAPI */
-    deinitializeTAPI();
+        /* Pending I/O must be gone before its structures are */
+        if(hCommFile != INVALID_HANDLE_VALUE)
+            deinitializeCommPort();
+    };
+    if(inIoThread())
+        shutdown();
+    else
+        callInIoThread(shutdown);
+
+    if(ioThread)
+    {
+        ioThread->quit();
+        ioThread->wait();
+        delete ioContext;
+        delete ioThread;
+    }
+
+    /* Handles we kept for reuse between calls */
+    if(tapiInboxEvent)
+        CloseHandle(tapiInboxEvent);
+    if(overlap.hEvent)
+        CloseHandle(overlap.hEvent);
+    foreach(WriteRequest *r, writeRequestPool)
+    {
+        CloseHandle(r->overlapped.hEvent);
+        delete r;
+    }
 }
 
 bool TAPIModem::initializeTAPI()
@@ -28,48 +87,39 @@ bool TAPIModem::initializeTAPI()
 
 bool TAPIModem::initializeTAPI(QString appName)
 {
-    if(tapiStateFlag == Initialized) return false;
+    /* With the I/O thread everything related to TAPI and the COM port runs there */
+    if(!inIoThread())
+        return callInIoThread([&]{ return initializeTAPI(appName); });
+    if(tapiState() == Initialized) return false;
 
 #if defined(QT_DEBUG) && defined(QTAPI_DEBUG)
     qDebug() << "QTapiModem - initializeTAPI: Starting TAPI initialization";
 #endif
 
-    LONG ret = 0;
-    LINEINITIALIZEEXPARAMS lineInitParams = {};
-
-    /* Set lineInitializeEX params */
-    lineInitParams.dwTotalSize = sizeof(lineInitParams);
-    lineInitParams.dwOptions = LINEINITIALIZEEXOPTION_USEEVENT;
-
-    /* Create TAPI supported API DWORD */
-    DWORD tapiSupportedApi = TAPI_SUPPORTED_API;
+    /* Messages for us are delivered to our inbox. The event is kept between initializations.
+     * It's manual-reset, since both the notifier and blocking waits watch it and neither may
+     * swallow it for the other. It stays signaled until on_TAPIevent() empties the inbox.
+     */
+    if(!tapiInboxEvent)
+        tapiInboxEvent = CreateEvent(NULL, true, false, NULL);
 
-    /* Try initializing TAPI */
-    do
+    /* TAPI is initialized only once per process, we just join it */
+    if(!TAPISession::instance()->acquire(appName, this))
     {
-        ret = lineInitializeEx(&hLineApp, NULL, NULL, appName.toStdWString().c_str(), &dwDeviceNumber, &tapiSupportedApi, &lineInitParams);
-
-#if defined(QT_DEBUG) && defined(QTAPI_DEBUG)
-        qDebug() << "QTapiModem - initializeTAPI: lineInitializeEx returned with value: " << ret;
-#endif
-        if(ret < 0 && ret != (LONG)LINEERR_REINIT)
-        {
-            errFlag = InitError;
-            emit errorOccurred(errFlag);
-            return false;
-        }
+        setError(InitError);
+        return false;
     }
-    while(ret == (LONG)LINEERR_REINIT);
+    hLineApp = TAPISession::instance()->lineApp();
+    dwDeviceNumber = TAPISession::instance()->deviceCount();
 
     /* Prepare event notifier */
-    tapiEventNotifier = new QWinEventNotifier(this);
-    connect(tapiEventNotifier, &QWinEventNotifier::activated, this, &TAPIModem::on_TAPIevent);
-    tapiEventNotifier->setHandle(lineInitParams.Handles.hEvent);
+    tapiEventNotifier = new QWinEventNotifier(ioObject());
+    connect(tapiEventNotifier, &QWinEventNotifier::activated, ioObject(), [this]{ on_TAPIevent(); });
+    tapiEventNotifier->setHandle(tapiInboxEvent);
     tapiEventNotifier->setEnabled(true);
 
     /* Change state */
-    tapiStateFlag = Initialized;
-    emit tapiStateChanged(tapiStateFlag);
+    setTapiState(Initialized);
 
 #if defined(QT_DEBUG) && defined(QTAPI_DEBUG)
     qDebug() << "QTapiModem - initializeTAPI: initialized successfully!";
@@ -78,47 +128,72 @@ bool TAPIModem::initializeTAPI(QString appName)
     return true;
 }
 
-void TAPIModem::connectToNumber()
+void TAPIModem::connectToNumber(OpenMode mode)
 {
-    if(tapiStateFlag == Uninitialized) return;
+    if(!inIoThread())
+        return callInIoThread([&]{ connectToNumber(mode); });
+    if(tapiState() == Uninitialized) return;
+
+    /* Modem is always read and written, the rest (like Unbuffered) is up to the user */
+    connectOpenMode = mode | QIODevice::ReadWrite;
 
     LONG ret = 0;
-    DWORD dwLocalAPIVersion;
     LINEEXTENSIONID lineExtensionId = {};
     LINECALLPARAMS lineCallParams = {};
 
-    /* Try to negotiate API version we will be using */
-    ret = lineNegotiateAPIVersion(hLineApp, dwDeviceId, 0x0010004, TAPI_SUPPORTED_API, &dwLocalAPIVersion, &lineExtensionId);
+    /* Line kept open from the previous call belongs to another modem, it can't be reused.
+     * There is no call on it, so it's just closed. Hanging up would report a disconnect nobody asked for.
+     */
+    lineMutex.lock();
+    if(hlDevice && hcCurrentCall == 0 && lineDeviceId != dwDeviceId)
+    {
+        lineClose(hlDevice);
+        TAPISession::instance()->unregisterLine(hlDevice);
+        hlDevice = 0;
+        lineApiVersion = 0;
+        lineMutex.unlock();
+        setLineState(LineClosed);
+    }
+    else
+        lineMutex.unlock();
+
+    /* Try to negotiate API version we will be using. A persistent line keeps the one it was opened with */
+    if(lineApiVersion == 0)
+    {
+        ret = lineNegotiateAPIVersion(hLineApp, dwDeviceId, 0x0010004, TAPI_SUPPORTED_API, &lineApiVersion, &lineExtensionId);
 
 #if defined(QT_DEBUG) && defined(QTAPI_DEBUG)
-    qDebug() << "QTapiModem - connectToNumber: lineNegotiateAPIVersion returned with value:" << ret;
+        qDebug() << "QTapiModem - connectToNumber: lineNegotiateAPIVersion returned with value:" << ret;
 #endif
-    if(ret < 0)
-    {
-        errFlag = ret == (LONG)LINEERR_NODEVICE || ret == (LONG)LINEERR_BADDEVICEID ? NoDeviceFoundError : NegotiationError;
-        emit errorOccurred(errFlag);
-        return;
+        if(ret < 0)
+        {
+            lineApiVersion = 0;
+            setError(ret == (LONG)LINEERR_NODEVICE || ret == (LONG)LINEERR_BADDEVICEID ? NoDeviceFoundError : NegotiationError);
+            return;
+        }
     }
 
     /* Try to open TAPI line device if not opened */
     lineMutex.lock();
     if(hlDevice == 0)
     {
-        ret = lineOpen(hLineApp, dwDeviceId, &hlDevice, dwLocalAPIVersion, 0, 0, LINECALLPRIVILEGE_OWNER, LINEMEDIAMODE_DATAMODEM, 0);
+        ret = lineOpen(hLineApp, dwDeviceId, &hlDevice, lineApiVersion, 0, 0, LINECALLPRIVILEGE_OWNER, LINEMEDIAMODE_DATAMODEM, 0);
 
 #if defined(QT_DEBUG) && defined(QTAPI_DEBUG)
         qDebug() << "QTapiModem - connectToNumber: lineOpen returned with value:" << ret;
 #endif
         if(ret < 0)
         {
+            hlDevice = 0;
+            lineApiVersion = 0;
             lineMutex.unlock();
-            errFlag = ret == (LONG)LINEERR_NODEVICE || ret == (LONG)LINEERR_BADDEVICEID ? NoDeviceFoundError : LineOpenError;
-            emit errorOccurred(errFlag);
+            setError(ret == (LONG)LINEERR_NODEVICE || ret == (LONG)LINEERR_BADDEVICEID ? NoDeviceFoundError : LineOpenError);
             return;
         }
         /* We got the line opened, so let's inform about it */
-        lineStateFlag = LineOpened;
-        emit lineStateChanged(lineStateFlag);
+        lineDeviceId = dwDeviceId;
+        TAPISession::instance()->registerLine(hlDevice, this);
+        setLineState(LineOpened);
 
         ret = lineSetStatusMessages(hlDevice, LINEDEVSTATE_CONNECTED | LINEDEVSTATE_DISCONNECTED | LINEDEVSTATE_OUTOFSERVICE | LINEDEVSTATE_MAINTENANCE | LINEDEVSTATE_CLOSE | LINEDEVSTATE_REINIT | LINEDEVSTATE_REMOVED, 0);
 
@@ -128,19 +203,19 @@ void TAPIModem::connectToNumber()
         if(ret < 0)
         {
             lineMutex.unlock();
-            errFlag = ret == (LONG)LINEERR_NODEVICE || ret == (LONG)LINEERR_BADDEVICEID ? NoDeviceFoundError : OperationError;
-            emit errorOccurred(errFlag);
+            setError(ret == (LONG)LINEERR_NODEVICE || ret == (LONG)LINEERR_BADDEVICEID ? NoDeviceFoundError : OperationError);
             return;
         }
-        lineMutex.unlock();
-
-        lineCallParams.dwTotalSize = sizeof(LINECALLPARAMS);
-        lineCallParams.dwBearerMode = LINEBEARERMODE_VOICE;
-        lineCallParams.dwMediaMode = LINEMEDIAMODE_DATAMODEM;
-        lineCallParams.dwCallParamFlags = LINECALLPARAMFLAGS_IDLE;
-        lineCallParams.dwAddressMode = LINEADDRESSMODE_ADDRESSID;
-        lineCallParams.dwAddressID = 0;
     }
+    lineMutex.unlock();
+
+    /* Parameters are needed for every call, also on a line that was already open */
+    lineCallParams.dwTotalSize = sizeof(LINECALLPARAMS);
+    lineCallParams.dwBearerMode = LINEBEARERMODE_VOICE;
+    lineCallParams.dwMediaMode = LINEMEDIAMODE_DATAMODEM;
+    lineCallParams.dwCallParamFlags = LINECALLPARAMFLAGS_IDLE;
+    lineCallParams.dwAddressMode = LINEADDRESSMODE_ADDRESSID;
+    lineCallParams.dwAddressID = 0;
 
     /* Try to make a call, if one is not existent */
     callMutex.lock();
@@ -154,31 +229,85 @@ void TAPIModem::connectToNumber()
         if(ret < 0)
         {
             callMutex.unlock();
-            errFlag = CallMakeError;
-            emit errorOccurred(errFlag);
+            setError(CallMakeError);
             return;
         }
+
+        /* The result comes in LINE_REPLY, route it to us */
+        TAPISession::instance()->registerRequest(ret, this);
     }
     callMutex.unlock();
 }
 
-void TAPIModem::connectToNumber(quint32 modemId, QString destNumber)
+void TAPIModem::connectToNumber(quint32 modemId, QString destNumber, OpenMode mode)
 {
     setDeviceId(modemId);
     setDestinationNumber(destNumber);
-    connectToNumber();
+    connectToNumber(mode);
 }
 
 void TAPIModem::endConnection()
 {
+    if(!inIoThread())
+        return callInIoThread([&]{ endConnection(); });
     /* Just hangup the call and reset states */
     hangupCall();
 
-    callStateFlag = CallDefaultState;
-    lineStateFlag = LineClosed;
-    disconnectFlag = DisconnectedByFunction;
-    emit callStateChanged(callStateFlag);
-    emit lineStateChanged(lineStateFlag);
+    setDisconnectReason(DisconnectedByFunction);
+    setCallState(CallDefaultState);
+    if(hlDevice == 0)
+        setLineState(LineClosed);
+}
+
+void TAPIModem::setPersistentLine(bool enabled)
+{
+    if(!inIoThread())
+        return callInIoThread([&]{ setPersistentLine(enabled); });
+    persistentLineMode = enabled;
+
+    /* Line is kept only between calls, there is no reason for it to stay open now */
+    if(!enabled && hlDevice && hcCurrentCall == 0)
+        releaseLine();
+}
+
+bool TAPIModem::persistentLine() const
+{
+    if(!inIoThread())
+        return callInIoThread([&]{ return persistentLine(); });
+    return persistentLineMode;
+}
+
+void TAPIModem::releaseLine()
+{
+    if(!inIoThread())
+        return callInIoThread([&]{ releaseLine(); });
+    /* Hangs up the call too, if there is one */
+    bool lineWasOpen = hlDevice != 0;
+    lineReleaseRequested = true;
+    hangupCall();
+    lineReleaseRequested = false;
+
+    if(lineWasOpen && hlDevice == 0)
+        setLineState(LineClosed);
+}
+
+bool TAPIModem::disconnectFromNumber(int msecs)
+{
+    /* Let the queued data leave before the line is dropped */
+    QDeadlineTimer deadline(msecs);
+    while(bytesToWrite() > 0 && !deadline.hasExpired())
+    {
+        if(!waitForBytesWritten((int)deadline.remainingTime()))
+            break;
+    }
+    bool drained = bytesToWrite() == 0;
+
+#if defined(QT_DEBUG) && defined(QTAPI_DEBUG)
+    qDebug() << "QTapiModem - disconnectFromNumber: outbound data drained:" << drained;
+#endif
+
+    endConnection();
+    return drained;
 }
 
 qint64 TAPIModem::bytesAvailable() const
@@ -189,102 +318,425 @@ qint64 TAPIModem::bytesAvailable() const
 bool TAPIModem::waitForReadyRead(int msecs)
 {
     /* Return false if all signs shows that the call is disconnected */
-    if(tapiStateFlag == Uninitialized && callStateFlag != CallConnected && lineStateFlag != LineOpened && hCommFile == INVALID_HANDLE_VALUE) return false;
+    if(tapiState() == Uninitialized && callState() != CallConnected && lineState() != LineOpened && hCommFile == INVALID_HANDLE_VALUE) return false;
 
-    /* Create timer and an Event Loop */
-    QEventLoop loop;
-    QTimer timer;
-    timer.setSingleShot(true);
-    connect(this, &QIODevice::readyRead, &loop, &QEventLoop::quit);
-    connect(&timer, &QTimer::timeout, &loop, &QEventLoop::quit);
+    return waitForModemEvent(WaitReadyRead, waitEvents[WaitReadyRead].loadAcquire(), msecs);
+}
 
-    /* And now trigger! */
-    timer.start(msecs);
-    loop.exec();
+bool TAPIModem::waitForConnected(int msecs)
+{
+    /* Return false if TAPI is uninitialized */
+    if(tapiState() == Uninitialized) return false;
 
-    /* We got a timeout */
-    if(!timer.isActive())
+    if(!waitForModemEvent(WaitConnected, waitEvents[WaitConnected].loadAcquire(), msecs) || callState() != CallConnected)
         return false;
 
-    /* We didn't get a timeout */
+    /* With the I/O thread the device is opened by a queued call, which can't run while we block it */
+    if(QThread::currentThread() == thread() && deviceOpenPending.loadAcquire())
+        openDevice();
+
     return true;
 }
 
-bool TAPIModem::waitForConnected(int msecs)
+bool TAPIModem::waitForDisconnected(int msecs)
 {
-    /* Return false if TAPI is uninitialized */
-    if(tapiStateFlag == Uninitialized) return false;
+    /* Return false if all signs shows that the call is disconnected */
+    if(tapiState() == Uninitialized || callState() != CallConnected || lineState() != LineOpened || hCommFile == INVALID_HANDLE_VALUE) return true;
 
+    return waitForModemEvent(WaitDisconnected, waitEvents[WaitDisconnected].loadAcquire(), msecs);
+}
 
-    /* Create timer and an Event Loop */
-    QEventLoop loop;
-    QTimer timer;
-    timer.setSingleShot(true);
-    connect(this, &TAPIModem::connected, &loop, &QEventLoop::quit);
-    connect(this, &TAPIModem::disconnected, &loop, &QEventLoop::quit);
-    connect(&timer, &QTimer::timeout, &loop, &QEventLoop::quit);
+bool TAPIModem::waitForBytesWritten(int msecs)
+{
+    if(bytesToWrite() == 0) return false;
 
-    /* And now trigger! */
-    timer.start(msecs);
-    loop.exec();
+    /* Data waiting for the coalescing delay would only wait longer, send it now.
+     * If the driver takes it right away, bytesWritten() is emitted before we wait.
+     */
+    quint32 since = waitEvents[WaitBytesWritten].loadAcquire();
+    flush();
 
-    /* We got a timeout */
-    if(!timer.isActive() || callStateFlag != CallConnected)
-        return false;
+    return waitForModemEvent(WaitBytesWritten, since, msecs);
+}
+
+bool TAPIModem::waitForModemEvent(WaitEvent event, quint32 since, int msecs)
+{
+    QDeadlineTimer deadline(msecs);
+    quint32 disconnects = waitEvents[WaitDisconnected].loadAcquire();
+
+    /* Losing the connection ends every wait, only waitForDisconnected() counts it as success */
+    auto happened = [&]{ return waitEvents[event].loadAcquire() != since; };
+    auto lost = [&]{ return event != WaitDisconnected && waitEvents[WaitDisconnected].loadAcquire() != disconnects; };
+
+    if(!inEventThread())
+    {
+        /* Events are handled by another thread (the I/O or the owner one), we just sleep until it tells us something happened.
+         * Handling them here would race with its notifiers on the same handles and buffers.
+         */
+        QMutexLocker locker(&waitMutex);
+        waitingThreads.fetchAndAddOrdered(1);
+        while(!happened() && !lost())
+        {
+            if(!waitCondition.wait(&waitMutex, deadline))
+                break;
+        }
+        waitingThreads.fetchAndAddOrdered(-1);
+
+        return happened();
+    }
+
+    /* We are the thread that handles events, so we wait on their handles directly and dispatch them ourselves.
+     * Nothing else runs in the meantime, unlike with a nested event loop.
+     */
+    while(true)
+    {
+        qint64 nextTimer = dispatchDueTimers();
+
+        if(happened()) return true;
+        if(lost() || deadline.hasExpired()) return false;
+
+        /* Collect what we can be woken up by */
+        HANDLE handles[3];
+        void (TAPIModem::*handlers[3])();
+        DWORD count = 0;
+        if(tapiEventNotifier)
+        {
+            handles[count] = tapiEventNotifier->handle();
+            handlers[count++] = &TAPIModem::on_TAPIevent;
+        }
+        /* While reads are batched the comm event stays signaled, the batch timer takes care of it */
+        if(hCommFile != INVALID_HANDLE_VALUE && !(readBatchTimer && readBatchTimer->isActive()))
+        {
+            handles[count] = overlap.hEvent;
+            handlers[count++] = &TAPIModem::on_COMevent;
+        }
+        if(!pendingWrites.isEmpty())
+        {
+            handles[count] = pendingWrites.first()->overlapped.hEvent;
+            handlers[count++] = &TAPIModem::com_writeCompleted;
+        }
+
+        /* Sleep until the deadline or the next timer, whichever comes first */
+        qint64 timeout = deadline.remainingTime();
+        if(nextTimer >= 0 && (timeout < 0 || nextTimer < timeout))
+            timeout = nextTimer;
+
+        /* Nothing could ever wake us up */
+        if(count == 0 && timeout < 0)
+            return false;
+
+        if(count == 0)
+        {
+            Sleep((DWORD)timeout);
+            continue;
+        }
+
+        DWORD ret = WaitForMultipleObjects(count, handles, false, timeout < 0 ? INFINITE : (DWORD)timeout);
+        if(ret == WAIT_TIMEOUT)
+            continue;
+        if(ret >= WAIT_OBJECT_0 + count)
+            return false;
+
+        (this->*handlers[ret - WAIT_OBJECT_0])();
+    }
+}
+
+void TAPIModem::signalWaiters(WaitEvent event)
+{
+    waitEvents[event].fetchAndAddOrdered(1);
+
+    /* Only threads sleeping on the condition need to be woken, the I/O thread sees the counter itself */
+    if(waitingThreads.loadAcquire() > 0)
+    {
+        QMutexLocker locker(&waitMutex);
+        waitCondition.wakeAll();
+    }
+}
+
+qint64 TAPIModem::dispatchDueTimers()
+{
+    /* Timers can't fire while a blocking wait holds their thread, so the due ones are run by hand.
+     * Members are read every time, since running a timer can hang up and delete them.
+     */
+    static const struct
+    {
+        QTimer * TAPIModem::*timer;
+        void (TAPIModem::*handler)();
+    } timers[] = {
+        {&TAPIModem::readBatchTimer, &TAPIModem::com_readBatchTimeout},
+        {&TAPIModem::readyReadFlushTimer, &TAPIModem::com_readyReadFlush},
+        {&TAPIModem::writeCoalescingTimer, &TAPIModem::com_writeCoalescingTimeout},
+        {&TAPIModem::transmitPaceTimer, &TAPIModem::com_writeCoalescingTimeout}
+    };
+
+    for(const auto &t : timers)
+    {
+        QTimer *timer = this->*t.timer;
+        if(timer && timer->isActive() && timer->remainingTime() == 0)
+        {
+            timer->stop();
+            (this->*t.handler)();
+        }
+    }
+
+    /* Time left to the nearest timer, -1 if none is running */
+    qint64 next = -1;
+    for(const auto &t : timers)
+    {
+        QTimer *timer = this->*t.timer;
+        if(timer && timer->isActive())
+            next = next < 0 ? timer->remainingTime() : qMin<qint64>(next, timer->remainingTime());
+    }
+
+    return next;
+}
+
+void TAPIModem::close()
+{
+    endConnection();
+    QIODevice::close();
+}
+
+bool TAPIModem::setIoThreadEnabled(bool enabled)
+{
+    /* Notifiers can't move between threads, so it can be changed only before TAPI is initialized */
+    if(tapiState() == Initialized) return false;
+    if(enabled == (ioThread != 0)) return true;
+
+    if(enabled)
+    {
+        ioThread = new QThread();
+        ioThread->setObjectName(QStringLiteral("TAPIModem I/O"));
+        ioContext = new QObject();
+        ioContext->moveToThread(ioThread);
+        ioThread->start(QThread::TimeCriticalPriority);
+    }
+    else
+    {
+        ioThread->quit();
+        ioThread->wait();
+        delete ioContext;
+        delete ioThread;
+        ioContext = 0;
+        ioThread = 0;
+    }
 
-    /* We didn't get a timeout */
     return true;
 }
 
-bool TAPIModem::waitForDisconnected(int msecs)
+TAPIModem::TAPIError TAPIModem::error() const
 {
-    /* Return false if all signs shows that the call is disconnected */
-    if(tapiStateFlag == Uninitialized || callStateFlag != CallConnected || lineStateFlag != LineOpened || hCommFile == INVALID_HANDLE_VALUE) return true;
+    return (TAPIError)(quint8)(statusWord.loadAcquire() >> TAPIModemStatus::ErrorShift);
+}
+
+void TAPIModem::clearError()
+{
+    updateStatus(TAPIModemStatus::ErrorShift, NoError);
+}
+
+TAPIModem::TAPIState TAPIModem::tapiState() const
+{
+    return (TAPIState)(quint8)(statusWord.loadAcquire() >> TAPIModemStatus::TapiStateShift);
+}
+
+TAPIModem::CallState TAPIModem::callState() const
+{
+    return (CallState)(quint8)(statusWord.loadAcquire() >> TAPIModemStatus::CallStateShift);
+}
+
+bool TAPIModem::hasCall() const
+{
+    /* Call state follows TAPI messages, the handle is there from lineMakeCall() until the hangup */
+    if(!inIoThread())
+        return callInIoThread([&]{ return hasCall(); });
+    return hcCurrentCall != 0;
+}
+
+TAPIModem::DisconnectReason TAPIModem::disconnectReason() const
+{
+    return (DisconnectReason)(quint8)(statusWord.loadAcquire() >> TAPIModemStatus::DisconnectReasonShift);
+}
 
+TAPIModem::LineState TAPIModem::lineState() const
+{
+    return (LineState)(quint8)(statusWord.loadAcquire() >> TAPIModemStatus::LineStateShift);
+}
+
+TAPIModemStatus TAPIModem::status() const
+{
+    /* Nothing is locked here, so it can be called from any thread at any time.
+     * The copy is retried until no write happened while it was taken.
+     */
+    TAPIModemStatus snapshot;
+    quint32 sequence;
+    do
+    {
+        sequence = statusSeqlock.loadAcquire();
+        snapshot.state = statusWord.loadRelaxed();
+        snapshot.received = statusBytesReceived.loadRelaxed();
+        snapshot.written = statusBytesWritten.loadRelaxed();
+        snapshot.connectedAt = statusConnectedTime.loadRelaxed();
+        snapshot.receivedAt = statusReceiveTime.loadRelaxed();
+        snapshot.writtenAt = statusWriteTime.loadRelaxed();
+        snapshot.changedAt = statusChangeTime.loadRelaxed();
+        std::atomic_thread_fence(std::memory_order_acquire);
+    } while((sequence & 1) || sequence != statusSeqlock.loadRelaxed());
+    return snapshot;
+}
 
-    /* Create timer and an Event Loop */
-    QEventLoop loop;
-    QTimer timer;
-    timer.setSingleShot(true);
-    connect(this, &TAPIModem::disconnected, &loop, &QEventLoop::quit);
-    connect(&timer, &QTimer::timeout, &loop, &QEventLoop::quit);
+void TAPIModem::beginStatusWrite()
+{
+    /* Writers come from the I/O thread and clearError(), so they are serialized.
+     * An odd sequence tells readers that a write is in progress.
+     */
+    statusWriteMutex.lock();
+    statusSeqlock.storeRelaxed(statusSeqlock.loadRelaxed() + 1);
+    std::atomic_thread_fence(std::memory_order_release);
+}
 
-    /* And now trigger! */
-    timer.start(msecs);
-    loop.exec();
+void TAPIModem::endStatusWrite()
+{
+    statusSeqlock.storeRelease(statusSeqlock.loadRelaxed() + 1);
+    statusWriteMutex.unlock();
+}
 
-    /* We got a timeout */
-    if(!timer.isActive())
+bool TAPIModem::storeStatus(int shift, quint8 value)
+{
+    /* Must be called between beginStatusWrite() and endStatusWrite() */
+    quint64 oldWord = statusWord.loadRelaxed();
+    if((quint8)(oldWord >> shift) == value)
         return false;
 
-    /* We didn't get a timeout */
+    quint64 newWord = (oldWord & ~((quint64)0xFF << shift)) | ((quint64)value << shift);
+    newWord += (quint64)1 << TAPIModemStatus::SequenceShift;
+    statusWord.storeRelease(newWord);
+    statusChangeTime.storeRelaxed(QDateTime::currentMSecsSinceEpoch());
     return true;
 }
 
-void TAPIModem::close()
+void TAPIModem::publishStatus()
 {
-    endConnection();
-    QIODevice::close();
+    /* A burst of changes is reported once, with the state after all of them */
+    if(statusChangePending.testAndSetOrdered(0, 1))
+    {
+        QMetaObject::invokeMethod(ioObject(), [this]{
+            statusChangePending.storeRelease(0);
+            emit statusChanged(status());
+        }, Qt::QueuedConnection);
+    }
+}
+
+bool TAPIModem::updateStatus(int shift, quint8 value)
+{
+    beginStatusWrite();
+    bool changed = storeStatus(shift, value);
+    endStatusWrite();
+
+    if(changed)
+        publishStatus();
+    return changed;
+}
+
+void TAPIModem::setError(TAPIError error)
+{
+    updateStatus(TAPIModemStatus::ErrorShift, error);
+    emit errorOccurred(error);
+}
+
+/* The per-state signals below are only emitted when the state really changes,
+ * statusChanged() is the one that carries the whole picture.
+ */
+void TAPIModem::setTapiState(TAPIState state)
+{
+    if(updateStatus(TAPIModemStatus::TapiStateShift, state))
+        emit tapiStateChanged(state);
+}
+
+void TAPIModem::setCallState(CallState state)
+{
+    beginStatusWrite();
+
+    /* Counters start over with every connection, in the same write as the state,
+     * so no snapshot mixes the counters of one call with the state of another.
+     */
+    if(state == CallConnected)
+    {
+        statusBytesReceived.storeRelaxed(0);
+        statusBytesWritten.storeRelaxed(0);
+        statusReceiveTime.storeRelaxed(0);
+        statusWriteTime.storeRelaxed(0);
+        statusConnectedTime.storeRelaxed(QDateTime::currentMSecsSinceEpoch());
+    }
+
+    bool changed = storeStatus(TAPIModemStatus::CallStateShift, state);
+    endStatusWrite();
+
+    if(changed)
+    {
+        publishStatus();
+        emit callStateChanged(state);
+    }
+}
+
+void TAPIModem::setLineState(LineState state)
+{
+    if(updateStatus(TAPIModemStatus::LineStateShift, state))
+        emit lineStateChanged(state);
+}
+
+void TAPIModem::setDisconnectReason(DisconnectReason reason)
+{
+    updateStatus(TAPIModemStatus::DisconnectReasonShift, reason);
+}
+
+void TAPIModem::countReceived(qint64 bytes)
+{
+    beginStatusWrite();
+    statusBytesReceived.storeRelaxed(statusBytesReceived.loadRelaxed() + bytes);
+    statusReceiveTime.storeRelaxed(QDateTime::currentMSecsSinceEpoch());
+    endStatusWrite();
+}
+
+void TAPIModem::countWritten(qint64 bytes)
+{
+    beginStatusWrite();
+    statusBytesWritten.storeRelaxed(statusBytesWritten.loadRelaxed() + bytes);
+    statusWriteTime.storeRelaxed(QDateTime::currentMSecsSinceEpoch());
+    endStatusWrite();
 }
 
 void TAPIModem::shutdownTAPI()
 {
-    if(tapiStateFlag == Uninitialized) return;
+    if(tapiState() == Uninitialized) return;
 
-    hangupCall();
+    releaseLine();
     deinitializeTAPI();
 }
 
 void TAPIModem::deinitializeTAPI()
 {
-    lineAppMutex.lock();
-    lineShutdown(hLineApp);
+    /* Error paths of hangupCall() could have done it already */
+    if(tapiState() == Uninitialized) return;
+
+    /* Other modems keep TAPI running, so a line left open would stay open */
+    lineMutex.lock();
+    if(hlDevice)
+    {
+        lineClose(hlDevice);
+        hlDevice = 0;
+        lineApiVersion = 0;
+    }
+    lineMutex.unlock();
+
+    /* No more messages are routed to us after this. TAPI shuts down when the last modem leaves */
+    TAPISession::instance()->release(this);
     hLineApp = 0;
-    lineAppMutex.unlock();
     delete tapiEventNotifier;
     tapiEventNotifier = nullptr;
-    tapiStateFlag = Uninitialized;
-    emit tapiStateChanged(tapiStateFlag);
+    tapiInboxMutex.lock();
+    tapiInbox.clear();
+    tapiInboxMutex.unlock();
+    setTapiState(Uninitialized);
 
 #if defined(QT_DEBUG) && defined(QTAPI_DEBUG)
     qDebug() << "QTapiModem - deinitializeTAPI: TAPI is shut down";
@@ -293,7 +745,7 @@ void TAPIModem::deinitializeTAPI()
 
 void TAPIModem::hangupCall()
 {
-    if(tapiStateFlag == Uninitialized) return;
+    if(tapiState() == Uninitialized) return;
 
 #if defined(QT_DEBUG) && defined(QTAPI_DEBUG)
     qDebug() << "QTapiModem - hangupCall: Starting call hangup";
@@ -308,6 +760,19 @@ void TAPIModem::hangupCall()
 #if defined(QT_DEBUG) && defined(QTAPI_DEBUG)
     qDebug() << "QTapiModem - hangupCall: COM port deinitialized";
 #endif
+    /* TAPI is shut down when the call can't be got rid of. Its handle is useless then,
+     * but we must not keep it, or the modem would look busy forever.
+     */
+    auto abandonCall = [this](TAPIError error)
+    {
+        TAPISession::instance()->unregisterCall(hcCurrentCall);
+        hcCurrentCall = 0;
+        callMutex.unlock();
+        setError(error);
+
+        deinitializeTAPI();
+    };
+
     /* If call is in progress, deallocate it */
     callMutex.lock();
     if(hcCurrentCall)
@@ -326,11 +791,8 @@ void TAPIModem::hangupCall()
             {
                 /* We got an error, now let's handle this */
                 LocalFree(lpLineCallStatus);
-                errFlag = CallStatusAquireError;
-                emit errorOccurred(errFlag);
-
-                deinitializeTAPI();
-                break;
+                abandonCall(CallStatusAquireError);
+                return;
             }
             if (lpLineCallStatus->dwTotalSize < lpLineCallStatus->dwNeededSize)
             {
@@ -369,10 +831,7 @@ void TAPIModem::hangupCall()
             if(ret < 0 && ret != (LONG)LINEERR_INVALCALLSTATE)
             {
                 /* We got an error, now let's handle this */
-                errFlag = CallDeallocationError;
-                emit errorOccurred(errFlag);
-
-                deinitializeTAPI();
+                abandonCall(CallDeallocationError);
                 return;
             }
         }
@@ -384,16 +843,20 @@ void TAPIModem::hangupCall()
     callMutex.unlock();
 
     lineMutex.lock();
-    /* Now let's try to close the line */
-    if(hlDevice)
+    /* Now let's try to close the line. Persistent line stays open for the next call. */
+    bool keepLine = persistentLineMode && !lineReleaseRequested;
+    if(hlDevice && !keepLine)
     {
         /* Try to close the line */
         ret = lineClose(hlDevice);
         if(ret < 0)
         {
-            /* We got an error, now let's handle this */
-            errFlag = LineDeallocationError;
-            emit errorOccurred(errFlag);
+            /* We got an error, now let's handle this. The call is already deallocated. */
+            lineMutex.unlock();
+            if(hcCurrentCall)
+                TAPISession::instance()->unregisterCall(hcCurrentCall);
+            hcCurrentCall = 0;
+            setError(LineDeallocationError);
 
             deinitializeTAPI();
             return;
@@ -404,14 +867,23 @@ void TAPIModem::hangupCall()
 #endif
     lineMutex.unlock();
 
+    /* Nothing else will come for these handles */
+    if(hcCurrentCall)
+        TAPISession::instance()->unregisterCall(hcCurrentCall);
+    if(hlDevice && !keepLine)
+    {
+        TAPISession::instance()->unregisterLine(hlDevice);
+        hlDevice = 0;
+        lineApiVersion = 0;
+    }
     hcCurrentCall = 0;
-    hlDevice = 0;
 
 #if defined(QT_DEBUG) && defined(QTAPI_DEBUG)
     qDebug() << "QTapiModem - hangupCall: hangup completed!";
 #endif
     /* We are disconnected by now */
     emit disconnected();
+    signalWaiters(WaitDisconnected);
 }
 
 void TAPIModem::deinitializeCommPort()
@@ -419,33 +891,89 @@ void TAPIModem::deinitializeCommPort()
     /* First we need to flush file buffers */
     FlushFileBuffers(hCommFile);
 
-    /* Now we need to cancel any pending IO operations */
+    /* Now we need to cancel any pending IO operations.
+     * Their OVERLAPPED structures are reused, so wait until the driver lets go of them.
+     */
     CancelIo(hCommFile);
+    DWORD cancelledBytes = 0;
+    if(!HasOverlappedIoCompleted(&overlap))
+        GetOverlappedResult(hCommFile, &overlap, &cancelledBytes, true);
+    foreach(WriteRequest *r, pendingWrites)
+    {
+        if(!HasOverlappedIoCompleted(&r->overlapped))
+            GetOverlappedResult(hCommFile, &r->overlapped, &cancelledBytes, true);
+    }
 
     /* Now we need to close the handle. It will prevent any futher IO operations */
     CloseHandle(hCommFile);
     hCommFile = INVALID_HANDLE_VALUE;
 
-    /* Delete our notifier */
+    /* Call ended before the owner thread got to open the device */
+    deviceOpenPending.storeRelease(0);
+
+    /* Delete our notifiers */
     if(commIOEventNotifier)
     {
         commIOEventNotifier->setEnabled(false);
         commIOEventNotifier->deleteLater();
         commIOEventNotifier = 0;
     }
-
-    /* Now close any pending event handlers on our pending writes list */
-    foreach(OVERLAPPED *o, pendingOverlappedWrites)
+    if(writeCompletionNotifier)
     {
-        CloseHandle(o->hEvent);
-        delete o;
+        writeCompletionNotifier->setEnabled(false);
+        writeCompletionNotifier->deleteLater();
+        writeCompletionNotifier = 0;
     }
-    pendingOverlappedWrites.clear();
 
-#if defined(QT_DEBUG) && defined(QTAPI_DEBUG)
-    qDebug() << "QTapiModem - deinitializeCommPort: COM port deinitialized!";
-#endif
-}
+    /* And the read batching timers */
+    if(readBatchTimer)
+    {
+        readBatchTimer->stop();
+        readBatchTimer->deleteLater();
+        readBatchTimer = 0;
+    }
+    if(readyReadFlushTimer)
+    {
+        readyReadFlushTimer->stop();
+        readyReadFlushTimer->deleteLater();
+        readyReadFlushTimer = 0;
+    }
+
+    if(writeCoalescingTimer)
+    {
+        writeCoalescingTimer->stop();
+        writeCoalescingTimer->deleteLater();
+        writeCoalescingTimer = 0;
+    }
+
+    /* Return pending writes to the pool, their events are reused by the next call */
+    foreach(WriteRequest *r, pendingWrites)
+        releaseWriteRequest(r);
+    pendingWrites.clear();
+
+    if(transmitPaceTimer)
+    {
+        transmitPaceTimer->stop();
+        transmitPaceTimer->deleteLater();
+        transmitPaceTimer = 0;
+    }
+    lineRateBps = 0;
+
+    /* Data that didn't make it before the hangup is lost */
+    for(OutboundQueue &queue : outboundQueues)
+    {
+        queue.chunks.clear();
+        queue.headOffset = 0;
+        queue.bytes = 0;
+        queue.currentWeight = 0;
+    }
+    pendingWriteBytes = 0;
+    writeBufferAboveMark = false;
+
+#if defined(QT_DEBUG) && defined(QTAPI_DEBUG)
+    qDebug() << "QTapiModem - deinitializeCommPort: COM port deinitialized!";
+#endif
+}
 
 qint64 TAPIModem::comBytesAvailable()
 {
@@ -465,66 +993,823 @@ qint64 TAPIModem::comBytesAvailable()
 
 qint64 TAPIModem::readData(char *data, qint64 maxlen)
 {
-    /* Check if maxlen is not bigger than available buffer size */
-    qint64 n = qMin(maxlen, (qint64)modemReadBuffer.size());
+    return readReceived(data, maxlen);
+}
 
-    /* No data, so return */
-    if(!n)
-        return 0;
+qint64 TAPIModem::readLineData(char *data, qint64 maxlen)
+{
+    if(maxlen <= 0) return 0;
 
-    /* Try to aquire n bytes */
-    if (!bufferSem.tryAcquire(n))
-        return 0;
+    /* Read up to and including the newline, or as much as fits if there is none */
+    qint64 index = findDelimiter("\n");
+    qint64 n = index >= 0 ? qMin(index + 1, maxlen) : maxlen;
 
-    /* Copy data to QIODevice buffer that was provided */
-    for(qint64 i = 0; i < n; i++)
-        data[i] = modemReadBuffer.at(i);
+    return readReceived(data, n);
+}
 
-    /* Erase data from our internal buffer */
-    modemReadBuffer.remove(0, n);
+bool TAPIModem::canReadLine() const
+{
+    return QIODevice::canReadLine() || findDelimiter("\n") >= 0;
+}
+
+QByteArray TAPIModem::readUntil(QByteArrayView delimiter)
+{
+    if(delimiter.isEmpty()) return QByteArray();
+
+    /* Data that QIODevice already pulled into its own buffer comes first */
+    qint64 buffered = QIODevice::bytesAvailable();
+    if(buffered > 0)
+    {
+        QByteArray bufferedData = QIODevice::peek(buffered);
+        qint64 index = bufferedData.indexOf(delimiter);
+        if(index >= 0)
+            return QIODevice::read(index + delimiter.size());
+
+        /* Delimiter could be split between both buffers */
+        if(delimiter.size() > 1)
+        {
+            qint64 tailLength = qMin<qint64>(buffered, delimiter.size() - 1);
+            QByteArray joint = bufferedData.right(tailLength);
+            QVarLengthArray<char, 32> head(delimiter.size() - 1);
+            qint64 headLength = modemReadBuffer.peek(head.data(), head.size());
+            joint.append(head.constData(), headLength);
+            index = joint.indexOf(delimiter);
+            if(index >= 0)
+                return QIODevice::read(buffered - tailLength + index + delimiter.size());
+        }
+    }
+
+    qint64 index = findDelimiter(delimiter);
+    if(index < 0) return QByteArray();
+
+    /* QIODevice empties its buffer first and then reads the rest from us */
+    return QIODevice::read(buffered + index + delimiter.size());
+}
+
+qint64 TAPIModem::findDelimiter(QByteArrayView delimiter) const
+{
+    /* Scan position is valid only for the delimiter it was found with */
+    if(scanDelimiter.size() != delimiter.size() || memcmp(scanDelimiter.constData(), delimiter.data(), (size_t)delimiter.size()) != 0)
+    {
+        scanDelimiter = delimiter.toByteArray();
+        scanPosition = 0;
+    }
+
+    qint64 available = modemReadBuffer.size();
+    qint64 index = modemReadBuffer.indexOf(delimiter, scanPosition);
+
+    /* Next search starts at the match, or where a match could still begin */
+    if(index >= 0)
+        scanPosition = index;
+    else
+        scanPosition = qMax<qint64>(scanPosition, available - delimiter.size() + 1);
+
+    return index;
+}
+
+qint64 TAPIModem::readReceived(char *data, qint64 maxlen)
+{
+    /* Copy data to the provided buffer and release it from our buffer.
+     * The buffer publishes how much was appended, so there is no need for any other
+     * accounting between us and com_readReady().
+     */
+    qint64 n = modemReadBuffer.read(data, maxlen);
+    receivedConsumed(n);
 
     return n;
 }
 
+void TAPIModem::receivedConsumed(qint64 len)
+{
+    /* Scanned data moved together with the read position */
+    scanPosition = qMax<qint64>(0, scanPosition - len);
+
+    /* Reader made enough room, receiving can be resumed. It must be done in our own thread. */
+    if(receivePaused.loadAcquire() == 1 && modemReadBuffer.size() <= readBufferLowWaterMark() && receivePaused.testAndSetOrdered(1, 2))
+        QMetaObject::invokeMethod(ioObject(), [this]{ com_resumeReceiving(); }, Qt::QueuedConnection);
+}
+
+QList<QByteArrayView> TAPIModem::peekSpans()
+{
+    QList<QByteArrayView> spans;
+
+    /* Data that QIODevice already pulled into its own buffer comes first.
+     * We can't point into it, so it's the only part that gets copied.
+     */
+    qint64 buffered = QIODevice::bytesAvailable();
+    if(buffered > 0)
+    {
+        /* Usually it's what is left of the last copy, then we point into that one again.
+         * Only one copy is kept, so it's replaced when that buffer got refilled.
+         */
+        QByteArray data = QIODevice::peek(buffered);
+        if(!deviceBufferCopy.endsWith(data))
+            deviceBufferCopy = data;
+        spans.append(QByteArrayView(deviceBufferCopy).last(buffered));
+    }
+    else
+        deviceBufferCopy.clear();
+
+    spans.append(modemReadBuffer.peekSpans());
+    return spans;
+}
+
+qint64 TAPIModem::consume(qint64 len)
+{
+    if(len <= 0) return 0;
+
+    /* Consume in the same order peekSpans() shows the data */
+    qint64 consumed = 0;
+    qint64 buffered = QIODevice::bytesAvailable();
+    if(buffered > 0)
+        consumed = QIODevice::skip(qMin(len, buffered));
+
+    /* Nobody can hold a view of unconsumed data from the copy anymore */
+    if(QIODevice::bytesAvailable() == 0)
+        deviceBufferCopy.clear();
+
+    if(consumed < len)
+    {
+        qint64 n = modemReadBuffer.skip(len - consumed);
+        receivedConsumed(n);
+        consumed += n;
+    }
+
+    return consumed;
+}
+
+QList<QByteArray> TAPIModem::readAllShared()
+{
+    QList<QByteArray> chunks;
+
+    qint64 buffered = QIODevice::bytesAvailable();
+    if(buffered > 0)
+        chunks.append(QIODevice::read(buffered));
+
+    QList<QByteArray> received = modemReadBuffer.readShared();
+    for(const QByteArray &chunk : received)
+        receivedConsumed(chunk.size());
+    chunks.append(received);
+
+    return chunks;
+}
+
 qint64 TAPIModem::writeData(const char *data, qint64 len)
 {
-    DWORD lastError = 0;
-    OVERLAPPED *newOverlappedWrite = new OVERLAPPED;
-    ZeroMemory(newOverlappedWrite, sizeof(OVERLAPPED));
-    newOverlappedWrite->hEvent = CreateEvent(NULL, true, false, NULL);
-    commMutex.lock();
-    if(WriteFile(hCommFile, (void *)data, (DWORD)len, NULL, newOverlappedWrite))
+    if(!inIoThread())
+        return callInIoThread([&]{ return writeData(data, len); });
+    /* Call is not connected (anymore), there is nothing to write to */
+    if(hCommFile == INVALID_HANDLE_VALUE) return -1;
+
+    /* Data is copied to our queue, so the caller can reuse its buffer right away */
+    enqueueWrite(NormalPriority, data, len);
+    updateWriteBufferLevel();
+    if(!startNextWrite(false))
+        return -1;
+
+    return len;
+}
+
+qint64 TAPIModem::write(const QByteArray &data)
+{
+    return write(data, NormalPriority);
+}
+
+qint64 TAPIModem::write(const QByteArray &data, WritePriority priority)
+{
+    if(!inIoThread())
+        return callInIoThread([&]{ return write(data, priority); });
+    /* Text mode needs QIODevice's conversion (data goes with normal priority then)
+     * and it also reports if we are not writable.
+     */
+    if(!isWritable() || (openMode() & QIODevice::Text))
+        return QIODevice::write(data.constData(), data.size());
+
+    if(hCommFile == INVALID_HANDLE_VALUE) return -1;
+    if(data.isEmpty()) return 0;
+
+    /* Small data is cheaper to copy into a batch than to send on its own.
+     * Large one is implicitly shared, the caller can keep using its copy and nothing gets copied.
+     */
+    if(data.size() < SHARED_WRITE_MINIMUM)
+        enqueueWrite(priority, data.constData(), data.size());
+    else
+        enqueueWrite(priority, data);
+
+    updateWriteBufferLevel();
+    if(!startNextWrite(false))
+        return -1;
+
+    return data.size();
+}
+
+qint64 TAPIModem::writeV(const QList<QByteArrayView> &pieces, WritePriority priority)
+{
+    return writePieces(pieces.constData(), pieces.size(), priority);
+}
+
+qint64 TAPIModem::writePieces(const QByteArrayView *pieces, qsizetype count, WritePriority priority)
+{
+    if(!inIoThread())
+        return callInIoThread([&]{ return writePieces(pieces, count, priority); });
+    if(!isWritable() || hCommFile == INVALID_HANDLE_VALUE) return -1;
+
+    /* All pieces are queued before anything is sent, so they go out together and in order.
+     * They are copied straight into the batches, there is no temporary buffer for the whole frame.
+     */
+    qint64 total = 0;
+    for(qsizetype i = 0; i < count; i++)
     {
-        /* Write finished now, we can delete our OVERLAPPED */
-        CloseHandle(newOverlappedWrite->hEvent);
-        delete newOverlappedWrite;
-        commMutex.unlock();
+        if(pieces[i].isEmpty()) continue;
+        enqueueWrite(priority, pieces[i].data(), pieces[i].size());
+        total += pieces[i].size();
     }
-    else if((lastError = GetLastError()) == ERROR_IO_PENDING)
+    if(total == 0) return 0;
+
+    updateWriteBufferLevel();
+    if(!startNextWrite(false))
+        return -1;
+
+    return total;
+}
+
+qint64 TAPIModem::bytesToWrite() const
+{
+    if(!inIoThread())
+        return callInIoThread([&]{ return bytesToWrite(); });
+    return queuedWriteBytes() + pendingWriteBytes + QIODevice::bytesToWrite();
+}
+
+qint64 TAPIModem::queuedWriteBytes() const
+{
+    qint64 bytes = 0;
+    for(const OutboundQueue &queue : outboundQueues)
+        bytes += queue.bytes;
+
+    return bytes;
+}
+
+qint64 TAPIModem::writeUrgent(QByteArrayView data)
+{
+    if(!inIoThread())
+        return callInIoThread([&]{ return writeUrgent(data); });
+    if(!isWritable() || hCommFile == INVALID_HANDLE_VALUE) return -1;
+    if(data.isEmpty()) return 0;
+
+    /* Urgent data is control data, it skips the other queues, the coalescing delay and pacing */
+    enqueueWrite(ControlPriority, data.data(), data.size());
+    updateWriteBufferLevel();
+    if(!startNextWrite(false))
+        return -1;
+
+    return data.size();
+}
+
+void TAPIModem::enqueueWrite(WritePriority priority, const char *data, qint64 len)
+{
+    OutboundQueue &queue = outboundQueues[priority];
+
+    /* Small writes are gathered in the last chunk, as long as it fits in one batch.
+     * Chunk shared with the caller or with a pending write must stay untouched, appending would copy it.
+     */
+    if(!queue.chunks.isEmpty() && queue.chunks.last().data.size() + len <= WRITE_BATCH_SIZE && queue.chunks.last().data.isDetached())
     {
-        /* Writing started asynchronously */
-        pendingOverlappedWrites.append(newOverlappedWrite);
-        commMutex.unlock();
+        queue.chunks.last().data.append(data, len);
     }
     else
     {
+        OutboundChunk chunk;
+        chunk.data.reserve(qMax(len, WRITE_BATCH_SIZE));
+        chunk.data.append(data, len);
+        chunk.queuedTime = writeClock.elapsed();
+        queue.chunks.append(chunk);
+    }
+    queue.bytes += len;
+    queue.bytesQueued += len;
+}
+
+void TAPIModem::enqueueWrite(WritePriority priority, const QByteArray &data)
+{
+    OutboundQueue &queue = outboundQueues[priority];
+
+    OutboundChunk chunk;
+    chunk.data = data;
+    chunk.queuedTime = writeClock.elapsed();
+    queue.chunks.append(chunk);
+    queue.bytes += data.size();
+    queue.bytesQueued += data.size();
+}
+
+int TAPIModem::nextWritePriority() const
+{
+    /* Control data always goes first */
+    if(outboundQueues[ControlPriority].bytes > 0)
+        return ControlPriority;
+
+    int next = -1;
+    if(strictPriority)
+    {
+        for(int priority = NormalPriority; priority < WritePriorityCount && next < 0; priority++)
+        {
+            if(outboundQueues[priority].bytes > 0)
+                next = priority;
+        }
+        return next;
+    }
+
+    /* Smooth weighted round robin. Every queue with data gets its share of batches,
+     * evenly spread, so bulk data can't starve the rest and isn't starved either.
+     * Weights only change in commitWritePriority(), once the write really starts.
+     */
+    for(int priority = NormalPriority; priority < WritePriorityCount; priority++)
+    {
+        const OutboundQueue &queue = outboundQueues[priority];
+        if(queue.bytes == 0) continue;
+
+        if(next < 0 || queue.currentWeight + queue.weight > outboundQueues[next].currentWeight + outboundQueues[next].weight)
+            next = priority;
+    }
+
+    return next;
+}
+
+void TAPIModem::commitWritePriority(int priority)
+{
+    if(strictPriority || priority == ControlPriority) return;
+
+    /* Must be called before the picked queue gives away its data, so the same queues take part */
+    int totalWeight = 0;
+    for(int other = NormalPriority; other < WritePriorityCount; other++)
+    {
+        OutboundQueue &queue = outboundQueues[other];
+        if(queue.bytes == 0) continue;
+
+        queue.currentWeight += queue.weight;
+        totalWeight += queue.weight;
+    }
+    outboundQueues[priority].currentWeight -= totalWeight;
+}
+
+void TAPIModem::setStrictWritePriority(bool strict)
+{
+    if(!inIoThread())
+        return callInIoThread([&]{ setStrictWritePriority(strict); });
+    strictPriority = strict;
+    for(OutboundQueue &queue : outboundQueues)
+        queue.currentWeight = 0;
+}
+
+bool TAPIModem::strictWritePriority() const
+{
+    if(!inIoThread())
+        return callInIoThread([&]{ return strictWritePriority(); });
+    return strictPriority;
+}
+
+void TAPIModem::setWritePriorityWeight(WritePriority priority, int weight)
+{
+    if(!inIoThread())
+        return callInIoThread([&]{ setWritePriorityWeight(priority, weight); });
+    outboundQueues[priority].weight = qMax(1, weight);
+}
+
+int TAPIModem::writePriorityWeight(WritePriority priority) const
+{
+    if(!inIoThread())
+        return callInIoThread([&]{ return writePriorityWeight(priority); });
+    return outboundQueues[priority].weight;
+}
+
+TAPIModem::WriteQueueStatistics TAPIModem::writeQueueStatistics(WritePriority priority) const
+{
+    if(!inIoThread())
+        return callInIoThread([&]{ return writeQueueStatistics(priority); });
+    const OutboundQueue &queue = outboundQueues[priority];
+
+    WriteQueueStatistics statistics;
+    statistics.bytesQueued = queue.bytesQueued;
+    statistics.bytesWritten = queue.bytesWritten;
+    statistics.bytesPending = queue.bytes;
+    statistics.averageQueueDelay = queue.delaySamples > 0 ? (double)queue.totalQueueDelay / queue.delaySamples : 0;
+    statistics.maximumQueueDelay = queue.maximumQueueDelay;
+
+    return statistics;
+}
+
+void TAPIModem::resetWriteQueueStatistics()
+{
+    if(!inIoThread())
+        return callInIoThread([&]{ resetWriteQueueStatistics(); });
+    for(OutboundQueue &queue : outboundQueues)
+    {
+        queue.bytesQueued = 0;
+        queue.bytesWritten = 0;
+        queue.delaySamples = 0;
+        queue.totalQueueDelay = 0;
+        queue.maximumQueueDelay = 0;
+    }
+}
+
+void TAPIModem::updateWriteBufferLevel()
+{
+    /* Signal only when crossing the mark, producers wait for bytesWritten() afterwards */
+    bool aboveMark = writeHighWaterMark > 0 && bytesToWrite() >= writeHighWaterMark;
+    if(aboveMark == writeBufferAboveMark) return;
+
+    writeBufferAboveMark = aboveMark;
+    if(aboveMark)
+        emit writeBufferFull();
+}
+
+void TAPIModem::setWriteBufferHighWaterMark(qint64 size)
+{
+    if(!inIoThread())
+        return callInIoThread([&]{ setWriteBufferHighWaterMark(size); });
+    writeHighWaterMark = qMax<qint64>(0, size);
+    updateWriteBufferLevel();
+}
+
+qint64 TAPIModem::writeBufferHighWaterMark() const
+{
+    if(!inIoThread())
+        return callInIoThread([&]{ return writeBufferHighWaterMark(); });
+    return writeHighWaterMark;
+}
+
+bool TAPIModem::startNextWrite(bool force)
+{
+    QList<qint64> chunksWritten;
+    bool pacing = transmitPacingTime > 0 && lineRateBps > 0;
+
+    /* Only a couple of writes are given to the driver at once, the rest gathers in the queue meanwhile */
+    while(pendingWrites.size() < writesInFlightLimit)
+    {
+        /* Queue is picked at every batch boundary. Control data doesn't wait for anything */
+        int priority = nextWritePriority();
+        if(priority < 0) break;
+        bool urgent = priority == ControlPriority;
+        OutboundQueue &queue = outboundQueues[priority];
+
+        /* One write never takes more than a batch, so urgent data doesn't wait long behind large chunks */
+        qint64 length = qMin(queue.chunks.first().data.size() - queue.headOffset, WRITE_BATCH_SIZE);
+
+        /* With a coalescing delay a partial batch waits a bit for more data */
+        if(!urgent && !force && coalescingDelay > 0 && queuedWriteBytes() < WRITE_BATCH_SIZE)
+        {
+            if(writeCoalescingTimer && !writeCoalescingTimer->isActive())
+                writeCoalescingTimer->start(coalescingDelay);
+            break;
+        }
+
+        /* Paced data waits until the line drained enough of what it already got */
+        if(pacing)
+        {
+            refillPaceCredit();
+            if(!urgent)
+            {
+                qint64 wanted = qMin(length, PACE_MINIMUM_WRITE);
+                if(paceCredit < wanted)
+                {
+                    int wait = qMax(1, (int)((wanted - paceCredit) * 10000.0 / lineRateBps + 0.5));
+                    if(transmitPaceTimer && !transmitPaceTimer->isActive())
+                        transmitPaceTimer->start(wait);
+                    break;
+                }
+                length = qMin(length, (qint64)paceCredit);
+            }
+            paceCredit -= length;
+        }
+
+        /* The write goes out now, the picked queue used up its turn */
+        commitWritePriority(priority);
+
+        /* How long the chunk waited, counted once when it starts going out */
+        if(queue.headOffset == 0)
+        {
+            qint64 delay = writeClock.elapsed() - queue.chunks.first().queuedTime;
+            queue.delaySamples++;
+            queue.totalQueueDelay += delay;
+            queue.maximumQueueDelay = qMax(queue.maximumQueueDelay, delay);
+        }
+
+        /* Write points into the queued chunk, nothing gets copied */
+        DWORD lastError = 0;
+        WriteRequest *pendingWrite = acquireWriteRequest();
+        pendingWrite->data = queue.chunks.first().data;
+        pendingWrite->offset = queue.headOffset;
+        pendingWrite->length = length;
+        pendingWrite->priority = priority;
+
+        queue.bytes -= length;
+        queue.headOffset += length;
+        if(queue.headOffset == queue.chunks.first().data.size())
+        {
+            queue.chunks.removeFirst();
+            queue.headOffset = 0;
+        }
+
+        commMutex.lock();
+        if(WriteFile(hCommFile, (void *)(pendingWrite->data.constData() + pendingWrite->offset), (DWORD)length, NULL, &pendingWrite->overlapped))
+        {
+            /* Write finished now, request can be reused */
+            commMutex.unlock();
+            chunksWritten.append(length);
+            queue.bytesWritten += length;
+            releaseWriteRequest(pendingWrite);
+        }
+        else if((lastError = GetLastError()) == ERROR_IO_PENDING)
+        {
+            /* Writing started asynchronously */
+            pendingWrites.append(pendingWrite);
+            pendingWriteBytes += length;
+            writesInFlightPeak = qMax(writesInFlightPeak, (int)pendingWrites.size());
+            commMutex.unlock();
+
+            /* First one in the queue, its event tells us when it's done */
+            if(pendingWrites.size() == 1)
+                watchWriteCompletion();
+        }
+        else
+        {
 #if defined(QT_DEBUG) && defined(QTAPI_DEBUG)
-        qDebug() << "QTapiModem - writeData: we got an error when writing data: " << lastError;
+            qDebug() << "QTapiModem - startNextWrite: we got an error when writing data: " << lastError;
 #endif
-        /* We got an error */
-        CancelIo(newOverlappedWrite->hEvent);
-        CloseHandle(newOverlappedWrite->hEvent);
-        delete newOverlappedWrite;
-        commMutex.unlock();
+            /* We got an error */
+            releaseWriteRequest(pendingWrite);
+            commMutex.unlock();
 
-        errFlag = CommWriteError;
-        emit errorOccurred(errFlag);
+            setError(CommWriteError);
 
-        hangupCall();
-        return -1;
+            hangupCall();
+            return false;
+        }
     }
 
-    return len;
+    /* Everything is on its way, nothing to wait for */
+    if(queuedWriteBytes() == 0)
+    {
+        if(writeCoalescingTimer)
+            writeCoalescingTimer->stop();
+        if(transmitPaceTimer)
+            transmitPaceTimer->stop();
+    }
+
+    if(!chunksWritten.isEmpty())
+    {
+        updateWriteBufferLevel();
+        for(qint64 bytes : chunksWritten)
+        {
+            countWritten(bytes);
+            emit bytesWritten(bytes);
+        }
+        signalWaiters(WaitBytesWritten);
+    }
+
+    return true;
+}
+
+qint64 TAPIModem::transmitPaceBudget() const
+{
+    /* Asynchronous line takes 10 bits per byte */
+    return qMax<qint64>(PACE_MINIMUM_WRITE, (qint64)lineRateBps * transmitPacingTime / 10000);
+}
+
+void TAPIModem::refillPaceCredit()
+{
+    /* Line drained this much since the last time, but we never get more ahead than the budget */
+    qint64 now = writeClock.elapsed();
+    paceCredit = qMin<double>(transmitPaceBudget(), paceCredit + (now - paceRefillTime) * (lineRateBps / 10000.0));
+    paceRefillTime = now;
+}
+
+void TAPIModem::setTransmitPacing(int lineTimeMsecs)
+{
+    if(!inIoThread())
+        return callInIoThread([&]{ setTransmitPacing(lineTimeMsecs); });
+    transmitPacingTime = qMax(0, lineTimeMsecs);
+    paceCredit = qMin<double>(paceCredit, transmitPaceBudget());
+
+    /* Data held back by the old setting could go now */
+    if(hCommFile != INVALID_HANDLE_VALUE)
+        startNextWrite(false);
+}
+
+quint32 TAPIModem::lineRate() const
+{
+    if(!inIoThread())
+        return callInIoThread([&]{ return lineRate(); });
+    return lineRateBps;
+}
+
+int TAPIModem::transmitPacing() const
+{
+    if(!inIoThread())
+        return callInIoThread([&]{ return transmitPacing(); });
+    return transmitPacingTime;
+}
+
+quint32 TAPIModem::queryLineRate()
+{
+    /* Rate is in the fixed part of the structure, so there is no need to grow it */
+    DWORD dwSizeOfCallInfo = sizeof(LINECALLINFO) + 1024;
+    LPLINECALLINFO lpCallInfo = (LPLINECALLINFO)LocalAlloc(LPTR, dwSizeOfCallInfo);
+    lpCallInfo->dwTotalSize = dwSizeOfCallInfo;
+
+    callMutex.lock();
+    LONG ret = lineGetCallInfo(hcCurrentCall, lpCallInfo);
+    callMutex.unlock();
+
+    quint32 rate = ret == 0 ? (quint32)lpCallInfo->dwRate : 0;
+    LocalFree(lpCallInfo);
+
+#if defined(QT_DEBUG) && defined(QTAPI_DEBUG)
+    qDebug() << "QTapiModem - queryLineRate: lineGetCallInfo returned with value:" << ret << ", line rate:" << rate;
+#endif
+    return rate;
+}
+
+TAPIModem::WriteRequest *TAPIModem::acquireWriteRequest()
+{
+    /* Pool is filled once, the first time we write */
+    if(writeRequestPool.isEmpty())
+    {
+        for(int i = 0; i < WRITE_REQUEST_POOL_SIZE; i++)
+        {
+            WriteRequest *request = new WriteRequest;
+            ZeroMemory(&request->overlapped, sizeof(OVERLAPPED));
+            request->overlapped.hEvent = CreateEvent(NULL, true, false, NULL);
+            writeRequestPool.append(request);
+        }
+        freeWriteRequests = writeRequestPool;
+    }
+
+    /* There is always a free one, writes in flight are limited to the pool size */
+    WriteRequest *request = freeWriteRequests.takeLast();
+
+    /* WriteFile resets the event by itself, the rest must be clean */
+    HANDLE hEvent = request->overlapped.hEvent;
+    ZeroMemory(&request->overlapped, sizeof(OVERLAPPED));
+    request->overlapped.hEvent = hEvent;
+
+    return request;
+}
+
+void TAPIModem::releaseWriteRequest(WriteRequest *request)
+{
+    request->data = QByteArray();
+    request->offset = 0;
+    request->length = 0;
+    request->priority = NormalPriority;
+    freeWriteRequests.append(request);
+}
+
+void TAPIModem::watchWriteCompletion()
+{
+    if(!writeCompletionNotifier) return;
+
+    /* Writes complete in the order they were issued, so only the oldest one is watched */
+    if(pendingWrites.isEmpty())
+    {
+        writeCompletionNotifier->setEnabled(false);
+        return;
+    }
+
+    writeCompletionNotifier->setHandle(pendingWrites.first()->overlapped.hEvent);
+    writeCompletionNotifier->setEnabled(true);
+}
+
+void TAPIModem::com_writeCompleted()
+{
+#if defined(QT_DEBUG) && defined(QTAPI_DEBUG)
+    qDebug() << "QTapiModem - com_writeCompleted: Some sending has been completed";
+#endif
+
+    /* Retire finished writes from the front of the queue, stop at the first unfinished one */
+    QList<qint64> chunksWritten;
+    commMutex.lock();
+    while(!pendingWrites.isEmpty() && HasOverlappedIoCompleted(&pendingWrites.first()->overlapped))
+    {
+        WriteRequest *request = pendingWrites.first();
+        DWORD bytes = 0;
+        if(!GetOverlappedResult(hCommFile, &request->overlapped, &bytes, false))
+        {
+#if defined(QT_DEBUG) && defined(QTAPI_DEBUG)
+            qDebug() << "QTapiModem - com_writeCompleted: An error occured when writing to device. Error code: " << GetLastError();
+#endif
+            commMutex.unlock();
+            /* We got an error when writing. Better close connection */
+            setError(CommWriteError);
+            hangupCall();
+            return;
+        }
+
+        pendingWrites.removeFirst();
+        pendingWriteBytes -= request->length;
+        outboundQueues[request->priority].bytesWritten += bytes;
+        releaseWriteRequest(request);
+        chunksWritten.append(bytes);
+    }
+    commMutex.unlock();
+
+    watchWriteCompletion();
+
+    /* Every chunk is reported on its own, in the order it was written. Before starting the next writes,
+     * which can finish right away and report their own chunks.
+     */
+    for(qint64 bytes : chunksWritten)
+    {
+        countWritten(bytes);
+        emit bytesWritten(bytes);
+    }
+    if(!chunksWritten.isEmpty())
+        signalWaiters(WaitBytesWritten);
+
+    /* Connection could have been ended by whoever got bytesWritten() */
+    if(hCommFile == INVALID_HANDLE_VALUE)
+        return;
+
+    /* Keep the driver busy with what gathered in the meantime */
+    if(!startNextWrite(true))
+        return;
+
+    updateWriteBufferLevel();
+}
+
+void TAPIModem::setMaximumWritesInFlight(int count)
+{
+    if(!inIoThread())
+        return callInIoThread([&]{ setMaximumWritesInFlight(count); });
+    writesInFlightLimit = qBound(1, count, WRITE_REQUEST_POOL_SIZE);
+
+    /* Limit could have been raised */
+    if(hCommFile != INVALID_HANDLE_VALUE)
+        startNextWrite(false);
+}
+
+int TAPIModem::maximumWritesInFlight() const
+{
+    if(!inIoThread())
+        return callInIoThread([&]{ return maximumWritesInFlight(); });
+    return writesInFlightLimit;
+}
+
+int TAPIModem::writesInFlight() const
+{
+    if(!inIoThread())
+        return callInIoThread([&]{ return writesInFlight(); });
+    return (int)pendingWrites.size();
+}
+
+int TAPIModem::peakWritesInFlight() const
+{
+    if(!inIoThread())
+        return callInIoThread([&]{ return peakWritesInFlight(); });
+    return writesInFlightPeak;
+}
+
+int TAPIModem::writeRequestPoolSize() const
+{
+    if(!inIoThread())
+        return callInIoThread([&]{ return writeRequestPoolSize(); });
+    return (int)writeRequestPool.size();
+}
+
+bool TAPIModem::flush()
+{
+    if(!inIoThread())
+        return callInIoThread([&]{ return flush(); });
+    if(hCommFile == INVALID_HANDLE_VALUE || queuedWriteBytes() == 0) return false;
+
+    /* Hand over what we can right away, without waiting for the coalescing delay */
+    qint64 queuedBytes = queuedWriteBytes();
+    if(!startNextWrite(true))
+        return false;
+
+    return queuedWriteBytes() < queuedBytes;
+}
+
+void TAPIModem::setWriteCoalescingDelay(int msecs)
+{
+    if(!inIoThread())
+        return callInIoThread([&]{ setWriteCoalescingDelay(msecs); });
+    coalescingDelay = qMax(0, msecs);
+
+    /* Without the delay queued data shouldn't wait anymore */
+    if(coalescingDelay == 0 && hCommFile != INVALID_HANDLE_VALUE)
+        startNextWrite(true);
+}
+
+int TAPIModem::writeCoalescingDelay() const
+{
+    if(!inIoThread())
+        return callInIoThread([&]{ return writeCoalescingDelay(); });
+    return coalescingDelay;
+}
+
+void TAPIModem::com_writeCoalescingTimeout()
+{
+    /* Data waited long enough for more data or for the line to drain, send what we can */
+    startNextWrite(true);
 }
 
 void TAPIModem::initializeCommPort()
@@ -551,19 +1836,10 @@ void TAPIModem::initializeCommPort()
     GetCommTimeouts(hCommFile, &commTimeouts);
     commMutex.unlock();
 
-    /* Next we need to set a few options related to timeouts
-     * it's safe to assume that after 250ms if we don't get
-     * any more characters the remote end finished transmitting
-     */
-    commTimeouts.ReadIntervalTimeout = 250;
-    commTimeouts.ReadTotalTimeoutMultiplier = 0;
-    commTimeouts.ReadTotalTimeoutConstant = 0;
-    commTimeouts.WriteTotalTimeoutMultiplier = 0;
-    commTimeouts.WriteTotalTimeoutConstant = 0;
-
-    commMutex.lock();
-    SetCommTimeouts(hCommFile, &commTimeouts);
-    commMutex.unlock();
+    /* Remember if the driver handles RTS by itself, we need it for the receive buffer limit */
+    commRtsHandshake = dcb.fRtsControl == RTS_CONTROL_HANDSHAKE;
+    commRtsCleared = false;
+    receivePaused.storeRelease(0);
 
     /* Errors on modem line are common */
     dcb.fAbortOnError = false;
@@ -571,61 +1847,268 @@ void TAPIModem::initializeCommPort()
     SetCommState(hCommFile, &dcb);
     commMutex.unlock();
 
-    /* Setup necessary structure for overlapped IO */
+    /* Setup necessary structure for overlapped IO. The event is kept between calls */
+    HANDLE hCommEvent = overlap.hEvent ? overlap.hEvent : CreateEvent(NULL, true, false, NULL);
     ZeroMemory(&overlap, sizeof(OVERLAPPED));
-    overlap.hEvent = CreateEvent(NULL, true, false, NULL);
+    overlap.hEvent = hCommEvent;
+    writesInFlightPeak = 0;
+    resetWriteQueueStatistics();
 
-    /* Set CommMask for the port */
-    commMutex.lock();
-    SetCommMask(hCommFile, EV_TXEMPTY | EV_RXCHAR);
-    commMutex.unlock();
+    /* Set timeouts, driver queues and CommMask for the port */
+    applyReadProfile();
 
     /* Set initial event notification */
-    commIOEventNotifier = new QWinEventNotifier(overlap.hEvent, this);
-    connect(commIOEventNotifier, &QWinEventNotifier::activated, this, &TAPIModem::on_COMevent);
+    commIOEventNotifier = new QWinEventNotifier(overlap.hEvent, ioObject());
+    connect(commIOEventNotifier, &QWinEventNotifier::activated, ioObject(), [this]{ on_COMevent(); });
     commIOEventNotifier->setEnabled(true);
 
+    /* Completion of writes is signaled by their own events, it's watched when there is something to watch */
+    writeCompletionNotifier = new QWinEventNotifier(ioObject());
+    connect(writeCompletionNotifier, &QWinEventNotifier::activated, ioObject(), [this]{ com_writeCompleted(); });
+
+    /* Timer for delaying reads when batching is enabled */
+    readBatchTimer = new QTimer(ioObject());
+    readBatchTimer->setSingleShot(true);
+    connect(readBatchTimer, &QTimer::timeout, ioObject(), [this]{ com_readBatchTimeout(); });
+
+    /* Timer for signaling data that didn't meet the notification policy in time */
+    readyReadFlushTimer = new QTimer(ioObject());
+    readyReadFlushTimer->setSingleShot(true);
+    connect(readyReadFlushTimer, &QTimer::timeout, ioObject(), [this]{ com_readyReadFlush(); });
+
+    /* Timer for sending partial write batches after the coalescing delay */
+    writeCoalescingTimer = new QTimer(ioObject());
+    writeCoalescingTimer->setSingleShot(true);
+    connect(writeCoalescingTimer, &QTimer::timeout, ioObject(), [this]{ com_writeCoalescingTimeout(); });
+
+    /* Timer for paced writes waiting for the line to drain. Pacing starts with full credit */
+    transmitPaceTimer = new QTimer(ioObject());
+    transmitPaceTimer->setSingleShot(true);
+    connect(transmitPaceTimer, &QTimer::timeout, ioObject(), [this]{ com_writeCoalescingTimeout(); });
+    writeClock.start();
+    paceRefillTime = 0;
+    paceCredit = transmitPaceBudget();
+
+    /* Start measuring the line from scratch */
+    inboundRate.reset();
+    rateClock.start();
+    adaptiveBatchInterval = 0;
+    adaptiveReadyReadThreshold = 1;
+
     WaitCommEvent(hCommFile,&receivedEventMask,&overlap);
 
 #if defined(QT_DEBUG) && defined(QTAPI_DEBUG)
     qDebug() << "QTapiModem - initializeCommPort: comm port initialized";
 #endif
 
-    /* Now we are connected */
-    QIODevice::open(QIODevice::ReadWrite);
-    emit connected();
+    /* Now we are connected. QIODevice belongs to the owner thread, so it's opened there */
+    if(!ioThread)
+        openDevice();
+    else
+    {
+        deviceOpenPending.storeRelease(1);
+        QMetaObject::invokeMethod(this, [this]{ openDevice(); }, Qt::QueuedConnection);
+    }
+}
+
+void TAPIModem::openDevice()
+{
+    /* waitForConnected() could have opened it already */
+    if(ioThread && !deviceOpenPending.testAndSetOrdered(1, 0))
+        return;
+
+    /* Device could still be open from the previous call, with a different mode */
+    if(isOpen())
+        QIODevice::close();
+    QIODevice::open(connectOpenMode);
+    emit connected();
+}
+
+void TAPIModem::setReadProfile(ReadProfile profile)
+{
+    if(!inIoThread())
+        return callInIoThread([&]{ setReadProfile(profile); });
+    /* There are no defaults for custom profile. Use the other overload. */
+    if(profile == CustomProfile) return;
+
+    readProfileFlag = profile;
+    readSettings = readProfilePreset(profile);
+    applyReadProfile();
+}
+
+TAPIModem::ReadProfile TAPIModem::readProfile() const
+{
+    if(!inIoThread())
+        return callInIoThread([&]{ return readProfile(); });
+    return readProfileFlag;
+}
+
+TAPIModem::ReadProfileSettings TAPIModem::readProfileSettings() const
+{
+    if(!inIoThread())
+        return callInIoThread([&]{ return readProfileSettings(); });
+    return readSettings;
+}
+
+void TAPIModem::setReadProfile(const ReadProfileSettings &settings)
+{
+    if(!inIoThread())
+        return callInIoThread([&]{ setReadProfile(settings); });
+    readProfileFlag = CustomProfile;
+    readSettings = settings;
+    applyReadProfile();
+}
+
+TAPIModem::ReadProfileSettings TAPIModem::readProfilePreset(ReadProfile profile)
+{
+    ReadProfileSettings settings;
+
+    switch(profile)
+    {
+    case LowLatencyProfile:
+        /* ReadFile returns immediately with whatever is in the queue
+         * and every received character is handled right away.
+         */
+        settings.readIntervalTimeout = MAXDWORD;
+        settings.readTotalTimeoutMultiplier = 0;
+        settings.readTotalTimeoutConstant = 0;
+        settings.inputQueueSize = 1024;
+        settings.outputQueueSize = 1024;
+        settings.eventMask = EV_RXCHAR;
+        settings.readBatchInterval = 0;
+        break;
+    case BulkProfile:
+        /* Large driver queues and data gathered for 50ms before reading,
+         * so every read and readyRead() carries a lot more data. We also
+         * want to know about overruns.
+         */
+        settings.readIntervalTimeout = 250;
+        settings.readTotalTimeoutMultiplier = 0;
+        settings.readTotalTimeoutConstant = 0;
+        settings.inputQueueSize = 65536;
+        settings.outputQueueSize = 16384;
+        settings.eventMask = EV_RXCHAR | EV_ERR;
+        settings.readBatchInterval = 50;
+        break;
+    case BalancedProfile:
+    default:
+        /* Defaults of the structure. It's the same what we were always using. */
+        break;
+    }
+
+    return settings;
+}
+
+void TAPIModem::applyReadProfile()
+{
+    /* Nothing to apply to. It will be applied when the call connects */
+    if(hCommFile == INVALID_HANDLE_VALUE || hCommFile == NULL) return;
+
+    COMMTIMEOUTS commTimeouts;
+
+    commMutex.lock();
+    GetCommTimeouts(hCommFile, &commTimeouts);
+    commMutex.unlock();
+
+    commTimeouts.ReadIntervalTimeout = readSettings.readIntervalTimeout;
+    commTimeouts.ReadTotalTimeoutMultiplier = readSettings.readTotalTimeoutMultiplier;
+    commTimeouts.ReadTotalTimeoutConstant = readSettings.readTotalTimeoutConstant;
+    commTimeouts.WriteTotalTimeoutMultiplier = 0;
+    commTimeouts.WriteTotalTimeoutConstant = 0;
+
+    /* Driver may refuse to resize its queues. It's only a recommendation, so we don't care. */
+    commMutex.lock();
+    SetupComm(hCommFile, readSettings.inputQueueSize, readSettings.outputQueueSize);
+    SetCommTimeouts(hCommFile, &commTimeouts);
+
+    /* If there is a pending WaitCommEvent, it will complete with empty mask and get armed again */
+    SetCommMask(hCommFile, readSettings.eventMask | EV_RXCHAR);
+    commMutex.unlock();
+
+#if defined(QT_DEBUG) && defined(QTAPI_DEBUG)
+    qDebug() << "QTapiModem - applyReadProfile: read profile applied:" << readProfileFlag;
+#endif
+}
+
+/* Now hold on, because here comes a spaghetti of a function */
+void TAPIModem::on_TAPIevent()
+{
+    int messages = 0;
+    QElapsedTimer handlingTime;
+    handlingTime.start();
+
+    /* Reset before draining, so a message posted from now on signals the event again */
+    ResetEvent(tapiInboxEvent);
+
+    /* Take everything that is queued, one activation can carry a whole burst of messages.
+     * Messages routed while we are busy are picked up by the next round.
+     */
+    while(true)
+    {
+        tapiInboxMutex.lock();
+        QList<LINEMESSAGE> batch;
+        batch.swap(tapiInbox);
+        tapiInboxMutex.unlock();
+
+        if(batch.isEmpty())
+            break;
+
+        for(const LINEMESSAGE &lmTapiMessage : batch)
+        {
+            messages++;
+            handleTAPIMessage(lmTapiMessage);
+
+            /* Message made us shut TAPI down, the rest is not for us anymore */
+            if(tapiState() == Uninitialized)
+                break;
+        }
+        if(tapiState() == Uninitialized)
+            break;
+    }
+
+    /* Keep track of how much work each activation brings */
+    qint64 elapsed = handlingTime.nsecsElapsed() / 1000;
+    dispatchStatistics.activations++;
+    if(messages == 0)
+        dispatchStatistics.emptyActivations++;
+    dispatchStatistics.messages += messages;
+    dispatchStatistics.maximumMessages = qMax(dispatchStatistics.maximumMessages, messages);
+    dispatchStatistics.maximumHandlingTime = qMax(dispatchStatistics.maximumHandlingTime, elapsed);
+    dispatchTotalTime += elapsed;
+}
+
+TAPIModem::TAPIDispatchStatistics TAPIModem::tapiDispatchStatistics() const
+{
+    if(!inIoThread())
+        return callInIoThread([&]{ return tapiDispatchStatistics(); });
+
+    TAPIDispatchStatistics statistics = dispatchStatistics;
+    statistics.averageHandlingTime = statistics.activations > 0 ? (double)dispatchTotalTime / statistics.activations : 0;
+
+    return statistics;
 }
 
-/* Now hold on, because here comes a spaghetti of a function */
-void TAPIModem::on_TAPIevent()
+void TAPIModem::resetTapiDispatchStatistics()
 {
-    LONG ret = 0;
-    DWORD dwTimeout = 10000;
-    LINEMESSAGE lmTapiMessage = {};
-
-    lineAppMutex.lock();
-    ret = lineGetMessage(hLineApp, &lmTapiMessage, dwTimeout);
-    lineAppMutex.unlock();
+    if(!inIoThread())
+        return callInIoThread([&]{ resetTapiDispatchStatistics(); });
+    dispatchStatistics = TAPIDispatchStatistics();
+    dispatchTotalTime = 0;
+}
 
-    switch(ret)
-    {
-    case LINEERR_INVALPOINTER:
-    case LINEERR_NOMEM:
-        /* Very serious errors, better shutdown TAPI */
-        shutdownTAPI();
-        errFlag = OperationError;
-        emit errorOccurred(errFlag);
-        return;
-    case LINEERR_INVALAPPHANDLE:
-    case LINEERR_OPERATIONFAILED:
-        /* TAPI has just shutdown or there aren't queued messages (which is weird) */
-        return;
-    default:
-        break;
-    }
+void TAPIModem::postTAPIMessage(const LINEMESSAGE &lmTapiMessage)
+{
+    /* Called by the session on its pump thread */
+    tapiInboxMutex.lock();
+    tapiInbox.append(lmTapiMessage);
+    tapiInboxMutex.unlock();
+    SetEvent(tapiInboxEvent);
+}
 
-    /* Check if LINE_CALLSTATE does apply to our call */
-    if((HCALL)lmTapiMessage.hDevice != hcCurrentCall)
+void TAPIModem::handleTAPIMessage(const LINEMESSAGE &lmTapiMessage)
+{
+    /* Check if LINE_CALLSTATE does apply to our call, the session could still route one for the previous call */
+    if(lmTapiMessage.dwMessageID == LINE_CALLSTATE && (HCALL)lmTapiMessage.hDevice != hcCurrentCall)
         return;
 
 #if defined(QT_DEBUG) && defined(QTAPI_DEBUG)
@@ -642,25 +2125,21 @@ void TAPIModem::on_TAPIevent()
         {
         /* For Dialing we will only inform. No need to take actions. */
         case LINECALLSTATE_DIALING:
-            callStateFlag = CallDialing;
-            emit callStateChanged(callStateFlag);
+            setCallState(CallDialing);
 
             break;
         case LINECALLSTATE_BUSY:
-            callStateFlag = CallBusy;
-            emit callStateChanged(callStateFlag);
+            setCallState(CallBusy);
 
             hangupCall();
             break;
         case LINECALLSTATE_IDLE:
-            callStateFlag = CallIdle;
-            emit callStateChanged(callStateFlag);
+            setCallState(CallIdle);
 
             hangupCall();
             break;
         case LINECALLSTATE_SPECIALINFO:
-            callStateFlag = CallCannotDial;
-            emit callStateChanged(callStateFlag);
+            setCallState(CallCannotDial);
 
             hangupCall();
             break;
@@ -668,29 +2147,28 @@ void TAPIModem::on_TAPIevent()
         case LINECALLSTATE_DISCONNECTED:
             switch(lmTapiMessage.dwParam2)
             {
-            case LINEDISCONNECTMODE_NORMAL: disconnectFlag = DisconnectByRemote; break;
-            case LINEDISCONNECTMODE_BUSY: disconnectFlag = DisconnectBusy; break;
-            case LINEDISCONNECTMODE_NOANSWER: disconnectFlag = DisconnectNoAnswer; break;
-            case LINEDISCONNECTMODE_REJECT: disconnectFlag = DisconnectReject; break;
-            case LINEDISCONNECTMODE_PICKUP: disconnectFlag = DisconnectPickup; break;
-            case LINEDISCONNECTMODE_FORWARDED: disconnectFlag = DisconnectForwarded; break;
-            case LINEDISCONNECTMODE_BADADDRESS: disconnectFlag = DisconnectBadAddress; break;
-            case LINEDISCONNECTMODE_UNREACHABLE: disconnectFlag = DisconnectUnreachable; break;
-            case LINEDISCONNECTMODE_CONGESTION: disconnectFlag = DisconnectCongestion; break;
-            case LINEDISCONNECTMODE_INCOMPATIBLE: disconnectFlag = DisconnectIncompatible; break;
-            case LINEDISCONNECTMODE_UNAVAIL: disconnectFlag = DisconnectUnavailable; break;
-            case LINEDISCONNECTMODE_NODIALTONE: disconnectFlag = DisconnectUnavailable; break;
-            case LINEDISCONNECTMODE_BLOCKED: disconnectFlag = DisconnectBlocked; break;
-            case LINEDISCONNECTMODE_CANCELLED: disconnectFlag = DisconnectCancelled; break;
-            case LINEDISCONNECTMODE_DONOTDISTURB: disconnectFlag = DisconnectDoNotDisturb; break;
-            case LINEDISCONNECTMODE_NUMBERCHANGED: disconnectFlag = DisconnectNumberChanged; break;
-            case LINEDISCONNECTMODE_OUTOFORDER: disconnectFlag = DisconnectOutOfOrder; break;
-            case LINEDISCONNECTMODE_QOSUNAVAIL: disconnectFlag = DisconnectQOSUnavailable; break;
-            case LINEDISCONNECTMODE_TEMPFAILURE: disconnectFlag = DisconnectTemporaryFailure; break;
-            default: disconnectFlag = DisconnectUnknown; break;
+            case LINEDISCONNECTMODE_NORMAL: setDisconnectReason(DisconnectByRemote); break;
+            case LINEDISCONNECTMODE_BUSY: setDisconnectReason(DisconnectBusy); break;
+            case LINEDISCONNECTMODE_NOANSWER: setDisconnectReason(DisconnectNoAnswer); break;
+            case LINEDISCONNECTMODE_REJECT: setDisconnectReason(DisconnectReject); break;
+            case LINEDISCONNECTMODE_PICKUP: setDisconnectReason(DisconnectPickup); break;
+            case LINEDISCONNECTMODE_FORWARDED: setDisconnectReason(DisconnectForwarded); break;
+            case LINEDISCONNECTMODE_BADADDRESS: setDisconnectReason(DisconnectBadAddress); break;
+            case LINEDISCONNECTMODE_UNREACHABLE: setDisconnectReason(DisconnectUnreachable); break;
+            case LINEDISCONNECTMODE_CONGESTION: setDisconnectReason(DisconnectCongestion); break;
+            case LINEDISCONNECTMODE_INCOMPATIBLE: setDisconnectReason(DisconnectIncompatible); break;
+            case LINEDISCONNECTMODE_UNAVAIL: setDisconnectReason(DisconnectUnavailable); break;
+            case LINEDISCONNECTMODE_NODIALTONE: setDisconnectReason(DisconnectUnavailable); break;
+            case LINEDISCONNECTMODE_BLOCKED: setDisconnectReason(DisconnectBlocked); break;
+            case LINEDISCONNECTMODE_CANCELLED: setDisconnectReason(DisconnectCancelled); break;
+            case LINEDISCONNECTMODE_DONOTDISTURB: setDisconnectReason(DisconnectDoNotDisturb); break;
+            case LINEDISCONNECTMODE_NUMBERCHANGED: setDisconnectReason(DisconnectNumberChanged); break;
+            case LINEDISCONNECTMODE_OUTOFORDER: setDisconnectReason(DisconnectOutOfOrder); break;
+            case LINEDISCONNECTMODE_QOSUNAVAIL: setDisconnectReason(DisconnectQOSUnavailable); break;
+            case LINEDISCONNECTMODE_TEMPFAILURE: setDisconnectReason(DisconnectTemporaryFailure); break;
+            default: setDisconnectReason(DisconnectUnknown); break;
             }
-            callStateFlag = CallDisconnected;
-            emit callStateChanged(callStateFlag);
+            setCallState(CallDisconnected);
 
             hangupCall();
             break;
@@ -700,7 +2178,7 @@ void TAPIModem::on_TAPIevent()
             /* Sometimes is possible for receiving multiple CONNECTED messages.
              * If we are connected it's better just to skip all of this.
              */
-            if(callStateFlag == CallConnected) break;
+            if(callState() == CallConnected) break;
 
 #if defined(QT_DEBUG) && defined(QTAPI_DEBUG)
             qDebug() << "QTapiModem - on_TAPIevent: Starting connection procedure";
@@ -729,8 +2207,7 @@ void TAPIModem::on_TAPIevent()
                     commMutex.unlock();
                     LocalFree(lpVarString);
 
-                    errFlag = CommAquireError;
-                    emit errorOccurred(errFlag);
+                    setError(CommAquireError);
 
                     hangupCall();
                     breakSwitch = true;
@@ -749,14 +2226,18 @@ void TAPIModem::on_TAPIevent()
             commMutex.lock();
             hCommFile = *(HANDLE *)((char *)lpVarString + lpVarString->dwStringOffset);
             commMutex.unlock();
+
+            /* Negotiated rate is needed for transmit pacing */
+            lineRateBps = queryLineRate();
             initializeCommPort();
 
 #if defined(QT_DEBUG) && defined(QTAPI_DEBUG)
             qDebug() << "QTapiModem - on_TAPIevent: call start procedure finished successfully";
 #endif
 
-            callStateFlag = CallConnected;
-            emit callStateChanged(callStateFlag);
+            /* Waiters check the call state, so it has to be published before they wake up */
+            setCallState(CallConnected);
+            signalWaiters(WaitConnected);
             break;
         }
         default:
@@ -766,9 +2247,13 @@ void TAPIModem::on_TAPIevent()
         break;
     }
     case LINE_CLOSE:
-        /* Line just got shutdown. Let's clean this and that */
-        lineStateFlag = LineClosed;
-        emit lineStateChanged(lineStateFlag);
+        /* Line just got shutdown. Its handle is no longer valid, so there is nothing to close or keep */
+        lineMutex.lock();
+        TAPISession::instance()->unregisterLine(hlDevice);
+        hlDevice = 0;
+        lineApiVersion = 0;
+        lineMutex.unlock();
+        setLineState(LineClosed);
 
         hangupCall();
         break;
@@ -782,8 +2267,7 @@ void TAPIModem::on_TAPIevent()
             {
             /* TAPI doesn't provide us any reason for why. They want us to shutdown. */
             case 0:
-                lineStateFlag = LineReinitialization;
-                emit lineStateChanged(lineStateFlag);
+                setLineState(LineReinitialization);
 
                 shutdownTAPI();
             /* We don't care for other reasons */
@@ -792,177 +2276,679 @@ void TAPIModem::on_TAPIevent()
             }
             break;
         case LINEDEVSTATE_OUTOFSERVICE:
-            lineStateFlag = LineOutOfService;
-            emit lineStateChanged(lineStateFlag);
+            setLineState(LineOutOfService);
 
+            /* The line handle is dead now, a persistent line must not keep it for the next call.
+             * Same as releaseLine(), but the line state keeps telling why it went away.
+             */
+            lineReleaseRequested = true;
             hangupCall();
+            lineReleaseRequested = false;
             break;
         case LINEDEVSTATE_DISCONNECTED:
-            lineStateFlag = LineDisconnected;
-            emit lineStateChanged(lineStateFlag);
+            setLineState(LineDisconnected);
+
+            hangupCall();
+            break;
+        case LINEDEVSTATE_MAINTENANCE:
+            setLineState(LineMaintenance);
+
+            hangupCall();
+            break;
+        case LINEDEVSTATE_REMOVED:
+            setLineState(LineDeviceRemoved);
+
+            /* The line handle is dead now, a persistent line must not keep it for the next call.
+             * Same as releaseLine(), but the line state keeps telling why it went away.
+             */
+            lineReleaseRequested = true;
+            hangupCall();
+            lineReleaseRequested = false;
+            break;
+        default:
+            break;
+        }
+        break;
+    case LINE_REPLY:
+        if(lmTapiMessage.dwParam2 != 0)
+        {
+            /* Whatever we were trying to do. Failed. Just close the line and forget about everything. */
+#if defined(QT_DEBUG) && defined(QTAPI_DEBUG)
+            qDebug() << "QTapiModem - on_TAPIevent: One of the asynch invoked TAPI functions failed! RequestId: " << lmTapiMessage.dwParam1 << " returned code: " << lmTapiMessage.dwParam2;
+#endif
+            setError(LineReplyError);
+
+            hangupCall();
+            break;
+        }
+        emit lineReplyOccured(QPrivateSignal(), lmTapiMessage.dwParam1, lmTapiMessage.dwParam2);
+        break;
+    case LINE_CREATE:
+        /* It informs us that new devices appeared. Not that we are instrested in. */
+        break;
+    default:
+        /* Ignore rest */
+        break;
+    }
+
+}
+
+void TAPIModem::on_COMevent()
+{
+#if defined(QT_DEBUG) && defined(QTAPI_DEBUG)
+    qDebug() << "QTapiModem - on_COMevent: COM port event received!";
+#endif
+
+    /* Activation left over after a blocking wait handled the event, or reads are being batched */
+    if(hCommFile == INVALID_HANDLE_VALUE || !HasOverlappedIoCompleted(&overlap) || (readBatchTimer && readBatchTimer->isActive()))
+        return;
+
+    if (receivedEventMask & EV_RXCHAR)
+        com_readReady();
+    if (receivedEventMask & EV_ERR)
+    {
+        /* Line error (overrun, framing etc). Clearing it is enough, we can't recover the data anyway */
+        DWORD errors = 0;
+        commMutex.lock();
+        ClearCommError(hCommFile, &errors, NULL);
+        commMutex.unlock();
+#if defined(QT_DEBUG) && defined(QTAPI_DEBUG)
+        qDebug() << "QTapiModem - on_COMevent: line error occured: " << errors;
+#endif
+    }
+
+    /* When batching reads, let the data gather in the driver before we wait again */
+    int batchInterval = adaptiveBatching ? adaptiveBatchInterval : readSettings.readBatchInterval;
+    if((receivedEventMask & EV_RXCHAR) && batchInterval > 0 && readBatchTimer)
+    {
+        /* The event stays signaled until we wait again, so stop watching it in the meantime */
+        commIOEventNotifier->setEnabled(false);
+        readBatchTimer->start(batchInterval);
+        return;
+    }
+
+    waitForCommEvent();
+}
+
+void TAPIModem::com_readBatchTimeout()
+{
+    /* Read everything that gathered in the meantime and start waiting for events again */
+    com_readReady();
+    waitForCommEvent();
+    if(commIOEventNotifier)
+        commIOEventNotifier->setEnabled(true);
+}
+
+void TAPIModem::com_readyReadFlush()
+{
+    /* Deadline passed, signal whatever we have even if it's below the threshold */
+    if(modemReadBuffer.size() > 0)
+    {
+        emit readyRead();
+        signalWaiters(WaitReadyRead);
+    }
+}
+
+void TAPIModem::setAdaptiveReadBatching(bool enabled, int targetLatency)
+{
+    if(!inIoThread())
+        return callInIoThread([&]{ setAdaptiveReadBatching(enabled, targetLatency); });
+    adaptiveBatching = enabled;
+    adaptiveTargetLatency = qMax(1, targetLatency);
+    adaptiveBatchInterval = 0;
+    adaptiveReadyReadThreshold = 1;
+
+    if(enabled)
+        retuneReadBatching();
+}
+
+bool TAPIModem::adaptiveReadBatching() const
+{
+    if(!inIoThread())
+        return callInIoThread([&]{ return adaptiveReadBatching(); });
+    return adaptiveBatching;
+}
+
+double TAPIModem::inboundByteRate() const
+{
+    if(!inIoThread())
+        return callInIoThread([&]{ return inboundByteRate(); });
+    if(!rateClock.isValid()) return 0;
+
+    return inboundRate.bytesPerSecond(rateClock.elapsed());
+}
+
+void TAPIModem::retuneReadBatching()
+{
+    /* How much data arrives during our target latency */
+    qint64 batchBytes = (qint64)(inboundByteRate() * adaptiveTargetLatency / 1000.0);
+
+    /* On slow lines there is nothing to gain from waiting, it would only add latency.
+     * On fast ones we wait the target time, so each event carries about that much line time.
+     */
+    if(batchBytes >= ADAPTIVE_MINIMUM_BATCH)
+    {
+        adaptiveBatchInterval = adaptiveTargetLatency;
+        adaptiveReadyReadThreshold = batchBytes;
+    }
+    else
+    {
+        adaptiveBatchInterval = 0;
+        adaptiveReadyReadThreshold = 1;
+    }
+}
+
+void TAPIModem::setReadNotificationPolicy(const ReadNotificationPolicy &policy)
+{
+    if(!inIoThread())
+        return callInIoThread([&]{ setReadNotificationPolicy(policy); });
+    notificationPolicy = policy;
+    notificationPolicy.minimumBytes = qMax<qint64>(1, policy.minimumBytes);
+
+    /* Don't keep data waiting under the old rules */
+    if(readyReadFlushTimer && readyReadFlushTimer->isActive())
+    {
+        readyReadFlushTimer->stop();
+        com_readyReadFlush();
+    }
+}
+
+TAPIModem::ReadNotificationPolicy TAPIModem::readNotificationPolicy() const
+{
+    if(!inIoThread())
+        return callInIoThread([&]{ return readNotificationPolicy(); });
+    return notificationPolicy;
+}
+
+void TAPIModem::notifyReadyRead(bool delimiterReceived)
+{
+    qint64 minimumBytes = notificationPolicy.minimumBytes;
+    int maximumDelay = notificationPolicy.maximumDelay;
+
+    /* Adaptive batching knows better how much data is worth waiting for */
+    if(adaptiveBatching)
+    {
+        minimumBytes = adaptiveReadyReadThreshold;
+        maximumDelay = adaptiveTargetLatency;
+    }
+
+    /* Enough data for the reader or a complete unit of it, signal it now */
+    if(delimiterReceived || modemReadBuffer.size() >= minimumBytes)
+    {
+        if(readyReadFlushTimer)
+            readyReadFlushTimer->stop();
+        emit readyRead();
+        signalWaiters(WaitReadyRead);
+        return;
+    }
+
+    /* Otherwise make sure the tail gets signaled before the deadline */
+    if(maximumDelay >= 0 && readyReadFlushTimer && !readyReadFlushTimer->isActive())
+        readyReadFlushTimer->start(maximumDelay);
+}
+
+void TAPIModem::waitForCommEvent()
+{
+    /* Connection could get closed while handling the event */
+    if(hCommFile == INVALID_HANDLE_VALUE) return;
+
+    WaitCommEvent(hCommFile, &receivedEventMask, &overlap);
+}
+
+void TAPIModem::com_readReady()
+{
+    qint64 bytesAvailable = 0;
+    qint64 bytesReceived = 0;
+    bool delimiterReceived = false;
+
+    /* Reader is behind, data waits in the driver until it catches up */
+    if(receivePaused.loadAcquire()) return;
+
+    if((bytesAvailable = comBytesAvailable()) > 0)
+    {
+        /* Don't take more than the receive buffer limit allows */
+        qint64 limit = readBufferLimit.loadRelaxed();
+        if(limit > 0)
+            bytesAvailable = qMin(bytesAvailable, limit - modemReadBuffer.size());
+
+#if defined(QT_DEBUG) && defined(QTAPI_DEBUG)
+        qDebug() << "QTapiModem - on_COMevent: Data is ready to be read: " << bytesAvailable << " bytes.";
+#endif
+        /* Read straight into the free space of our buffer, one block at a time */
+        while(bytesAvailable > 0)
+        {
+            DWORD bytesReturned = 0;
+            qint64 bytesReserved = 0;
+            char *buff = modemReadBuffer.reserve(bytesAvailable, &bytesReserved);
+
+            OVERLAPPED overlappedRead;
+            ZeroMemory(&overlappedRead, sizeof(OVERLAPPED));
+            if(!ReadFile(hCommFile, (void *)buff, (DWORD)bytesReserved, &bytesReturned, &overlappedRead))
+            {
+                if(GetLastError() == ERROR_IO_PENDING)
+                    GetOverlappedResult(hCommFile, &overlappedRead, &bytesReturned, true);
+                else
+                {
+                    /* We got an error when reading. Better close connection */
+                    hangupCall();
+                    setError(CommReadError);
+                    return;
+                }
+            }
+
+            /* Look for the delimiter only in what we just got */
+            if(notificationPolicy.delimiter >= 0 && !delimiterReceived)
+                delimiterReceived = memchr(buff, notificationPolicy.delimiter, bytesReturned) != nullptr;
+
+            /* Make the data visible to the reader */
+            modemReadBuffer.commit((qint64)bytesReturned);
+            bytesReceived += bytesReturned;
+
+            /* Driver gave us less than it promised, nothing more to read for now */
+            if((qint64)bytesReturned < bytesReserved)
+                break;
+            bytesAvailable -= bytesReturned;
+        }
+
+        if(bytesReceived > 0)
+        {
+            /* Keep track of the line rate */
+            inboundRate.addBytes(bytesReceived, rateClock.elapsed());
+            countReceived(bytesReceived);
+            if(adaptiveBatching)
+                retuneReadBatching();
+
+            /* Emit readyRead signal */
+            notifyReadyRead(delimiterReceived);
+        }
+    }
+
+    /* Buffer is full, stop receiving until the reader makes some room */
+    qint64 limit = readBufferLimit.loadRelaxed();
+    if(limit > 0 && modemReadBuffer.size() >= limit)
+        pauseReceiving();
+}
+
+void TAPIModem::setReadBufferSize(qint64 size)
+{
+    if(!inIoThread())
+        return callInIoThread([&]{ setReadBufferSize(size); });
+    readBufferLimit.storeRelease(qMax<qint64>(0, size));
+
+    /* Limit could have been lifted or raised, check if we should carry on */
+    if(receivePaused.loadAcquire() && (readBufferLimit.loadRelaxed() == 0 || modemReadBuffer.size() <= readBufferLowWaterMark()))
+        QMetaObject::invokeMethod(ioObject(), [this]{ com_resumeReceiving(); }, Qt::QueuedConnection);
+}
+
+void TAPIModem::setReadBufferLowWaterMark(qint64 size)
+{
+    if(!inIoThread())
+        return callInIoThread([&]{ setReadBufferLowWaterMark(size); });
+    readBufferResumeLimit.storeRelease(size);
+
+    /* Mark could have been raised above what is buffered now. The reader may be resuming at the same time. */
+    if(modemReadBuffer.size() <= readBufferLowWaterMark() && receivePaused.testAndSetOrdered(1, 2))
+        QMetaObject::invokeMethod(ioObject(), [this]{ com_resumeReceiving(); }, Qt::QueuedConnection);
+}
+
+qint64 TAPIModem::readBufferLowWaterMark() const
+{
+    /* Called by the reader too, so both limits are read once */
+    qint64 limit = readBufferLimit.loadAcquire();
+    qint64 resumeLimit = readBufferResumeLimit.loadAcquire();
+
+    /* By default resume at half of the buffer */
+    if(resumeLimit < 0 || resumeLimit >= limit)
+        return limit / 2;
+
+    return resumeLimit;
+}
+
+void TAPIModem::pauseReceiving()
+{
+    if(!receivePaused.testAndSetOrdered(0, 1)) return;
+
+    /* With RTS handshaking the driver drops RTS by itself, once its queue fills up.
+     * Otherwise we have to do it ourselves.
+     */
+    if(!commRtsHandshake)
+    {
+        commMutex.lock();
+        commRtsCleared = EscapeCommFunction(hCommFile, CLRRTS) != FALSE;
+        commMutex.unlock();
+    }
+
+#if defined(QT_DEBUG) && defined(QTAPI_DEBUG)
+    qDebug() << "QTapiModem - pauseReceiving: receive buffer is full, receiving paused";
+#endif
+
+    emit receiveBufferFull();
+}
+
+void TAPIModem::com_resumeReceiving()
+{
+    if(!receivePaused.loadAcquire()) return;
+    receivePaused.storeRelease(0);
+
+    if(hCommFile == INVALID_HANDLE_VALUE) return;
+
+    /* Let the modem send again */
+    if(commRtsCleared)
+    {
+        commMutex.lock();
+        EscapeCommFunction(hCommFile, SETRTS);
+        commMutex.unlock();
+        commRtsCleared = false;
+    }
+
+#if defined(QT_DEBUG) && defined(QTAPI_DEBUG)
+    qDebug() << "QTapiModem - com_resumeReceiving: receiving resumed";
+#endif
+
+    /* Data that waited in the driver won't trigger another event, so read it now */
+    com_readReady();
+}
+
+TAPISession *TAPISession::instance()
+{
+    static TAPISession session;
+    return &session;
+}
+
+bool TAPISession::acquire(const QString &appName, TAPIModem *modem)
+{
+    QMutexLocker locker(&lifecycleMutex);
+
+    /* TAPI asked for reinitialization. The old application is useless, but it can be shut down
+     * only when every modem has left it. Until then nobody can join.
+     */
+    if(userCount > 0 && reinitPending.loadAcquire())
+    {
+#if defined(QT_DEBUG) && defined(QTAPI_DEBUG)
+        qDebug() << "TAPISession - acquire: refused, waiting for" << userCount << "users to leave before reinitialization";
+#endif
+        return false;
+    }
+
+    if(userCount == 0)
+    {
+        LONG ret = 0;
+        LINEINITIALIZEEXPARAMS lineInitParams = {};
+
+        /* Set lineInitializeEX params */
+        lineInitParams.dwTotalSize = sizeof(lineInitParams);
+        lineInitParams.dwOptions = LINEINITIALIZEEXOPTION_USEEVENT;
+
+        /* Create TAPI supported API DWORD */
+        DWORD tapiSupportedApi = TAPI_SUPPORTED_API;
+
+        /* Try initializing TAPI */
+        do
+        {
+            ret = lineInitializeEx(&hLineApp, NULL, NULL, appName.toStdWString().c_str(), &dwDeviceNumber, &tapiSupportedApi, &lineInitParams);
+
+#if defined(QT_DEBUG) && defined(QTAPI_DEBUG)
+            qDebug() << "TAPISession - acquire: lineInitializeEx returned with value: " << ret;
+#endif
+            if(ret < 0 && ret != (LONG)LINEERR_REINIT)
+            {
+                hLineApp = 0;
+                return false;
+            }
+        }
+        while(ret == (LONG)LINEERR_REINIT);
+
+        /* Messages are taken on a thread of our own, so no modem's thread can hold them up */
+        pumpThread = new QThread();
+        pumpThread->setObjectName(QStringLiteral("TAPISession pump"));
+        pumpContext = new QObject();
+        pumpContext->moveToThread(pumpThread);
+        pumpThread->start(QThread::TimeCriticalPriority);
+
+        HANDLE hEvent = lineInitParams.Handles.hEvent;
+        QMetaObject::invokeMethod(pumpContext, [this, hEvent]
+        {
+            pumpNotifier = new QWinEventNotifier(hEvent, pumpContext);
+            QObject::connect(pumpNotifier, &QWinEventNotifier::activated, pumpContext, [this]{ on_TAPIevent(); });
+            pumpNotifier->setEnabled(true);
+        }, Qt::BlockingQueuedConnection);
+
+#if defined(QT_DEBUG) && defined(QTAPI_DEBUG)
+        qDebug() << "TAPISession - acquire: TAPI initialized";
+#endif
+    }
+
+    userCount++;
+    if(modem)
+    {
+        routeMutex.lock();
+        modems.append(modem);
+        routeMutex.unlock();
+    }
+
+    return true;
+}
+
+void TAPISession::release(TAPIModem *modem)
+{
+    QMutexLocker locker(&lifecycleMutex);
+    if(userCount == 0) return;
+
+    /* Forget everything that leads to the modem, it may be gone right after this.
+     * A modem that already left must not take another user with it.
+     */
+    if(modem)
+    {
+        routeMutex.lock();
+        if(modems.removeAll(modem) == 0)
+        {
+            routeMutex.unlock();
+            return;
+        }
+        auto forget = [modem](auto &map)
+        {
+            for(auto it = map.begin(); it != map.end();)
+                it = it.value() == modem ? map.erase(it) : std::next(it);
+        };
+        forget(lines);
+        forget(calls);
+        forget(requests);
+        routeMutex.unlock();
+    }
+
+    if(--userCount > 0) return;
 
-            hangupCall();
-            break;
-        case LINEDEVSTATE_MAINTENANCE:
-            lineStateFlag = LineMaintenance;
-            emit lineStateChanged(lineStateFlag);
+    /* Last one out. Stop the pump first, so nothing touches the handle while it's shut down */
+    QMetaObject::invokeMethod(pumpContext, [this]{ delete pumpNotifier; pumpNotifier = 0; }, Qt::BlockingQueuedConnection);
+    pumpThread->quit();
+    pumpThread->wait();
+    delete pumpContext;
+    delete pumpThread;
+    pumpContext = 0;
+    pumpThread = 0;
 
-            hangupCall();
-            break;
-        case LINEDEVSTATE_REMOVED:
-            lineStateFlag = LineDeviceRemoved;
-            emit lineStateChanged(lineStateFlag);
+    lineShutdown(hLineApp);
+    hLineApp = 0;
+    dwDeviceNumber = 0;
+    reinitPending.storeRelease(0);
+
+    routeMutex.lock();
+    unclaimedReplies.clear();
+    unclaimedOrder.clear();
+    routeMutex.unlock();
 
-            hangupCall();
-            break;
-        default:
-            break;
-        }
-        break;
-    case LINE_REPLY:
-        if(lmTapiMessage.dwParam2 != 0)
-        {
-            /* Whatever we were trying to do. Failed. Just close the line and forget about everything. */
 #if defined(QT_DEBUG) && defined(QTAPI_DEBUG)
-            qDebug() << "QTapiModem - on_TAPIevent: One of the asynch invoked TAPI functions failed! RequestId: " << lmTapiMessage.dwParam1 << " returned code: " << lmTapiMessage.dwParam2;
+    qDebug() << "TAPISession - release: TAPI is shut down";
 #endif
-            errFlag = LineReplyError;
-            emit errorOccurred(errFlag);
+}
 
-            hangupCall();
-            break;
-        }
-        emit lineReplyOccured(QPrivateSignal(), lmTapiMessage.dwParam1, lmTapiMessage.dwParam2);
-        break;
-    case LINE_CREATE:
-        /* It informs us that new devices appeared. Not that we are instrested in. */
-        break;
-    default:
-        /* Ignore rest */
-        break;
+void TAPISession::registerLine(HLINE line, TAPIModem *modem)
+{
+    QMutexLocker locker(&routeMutex);
+    lines.insert(line, modem);
+}
+
+void TAPISession::unregisterLine(HLINE line)
+{
+    QMutexLocker locker(&routeMutex);
+    TAPIModem *modem = lines.take(line);
+
+    /* Calls offered on the line, which the modem never took, go away with it */
+    if(modem)
+    {
+        for(auto it = calls.begin(); it != calls.end();)
+            it = it.value() == modem ? calls.erase(it) : std::next(it);
     }
+}
 
+void TAPISession::unregisterCall(HCALL call)
+{
+    QMutexLocker locker(&routeMutex);
+    calls.remove(call);
 }
 
-void TAPIModem::on_COMevent()
+void TAPISession::registerRequest(LONG requestId, TAPIModem *modem)
 {
-#if defined(QT_DEBUG) && defined(QTAPI_DEBUG)
-    qDebug() << "QTapiModem - on_COMevent: COM port event received!";
-#endif
+    QMutexLocker locker(&routeMutex);
 
-    if (receivedEventMask & EV_RXCHAR)
-        com_readReady();
-    if (receivedEventMask & EV_TXEMPTY)
+    /* Reply could have been faster than us */
+    auto it = unclaimedReplies.find((DWORD)requestId);
+    if(it != unclaimedReplies.end())
     {
-#if defined(QT_DEBUG) && defined(QTAPI_DEBUG)
-        qDebug() << "QTapiModem - on_COMevent: Some sending has been completed";
-#endif
+        modem->postTAPIMessage(it.value());
+        unclaimedReplies.erase(it);
+        unclaimedOrder.removeOne((DWORD)requestId);
+        return;
+    }
+    requests.insert((DWORD)requestId, modem);
+}
 
-        /* Write completed. Now we need to clear the OVERLAPPED write list. */
-        qint64 totalBytesWritten = 0;
-        QList<OVERLAPPED *> overlappedWritesToDelete;
-        commMutex.lock();
-        foreach(OVERLAPPED *o, pendingOverlappedWrites)
+void TAPISession::on_TAPIevent()
+{
+    LONG ret = 0;
+    LINEMESSAGE lmTapiMessage = {};
+
+    /* Take everything that is queued, without waiting for more */
+    while(true)
+    {
+        ret = lineGetMessage(hLineApp, &lmTapiMessage, 0);
+
+        if(ret == (LONG)LINEERR_INVALPOINTER || ret == (LONG)LINEERR_NOMEM)
         {
-            DWORD bytes = 0;
-            bool getOverlappedResult = GetOverlappedResult(hCommFile, o, &bytes, false);
-            DWORD getLastError = GetLastError();
-            if(getOverlappedResult)
-            {
-                totalBytesWritten += bytes;
-                overlappedWritesToDelete.append(o);
-            }
-            else if (getLastError != ERROR_IO_INCOMPLETE)
-            {
+            /* Very serious errors. TAPI can't be used anymore, so every modem is told to shut it down */
 #if defined(QT_DEBUG) && defined(QTAPI_DEBUG)
-                qDebug() << "QTapiModem - on_COMevent: An error occured when writing to device. Error code: " << getLastError;
+            qDebug() << "TAPISession - on_TAPIevent: lineGetMessage failed: " << ret;
 #endif
-                commMutex.unlock();
-                /* We got an error when writing. Better close connection */
-                errFlag = CommWriteError;
-
-                emit errorOccurred(errFlag);
-                hangupCall();
-                return;
-            }
-        }
-        foreach(OVERLAPPED *o, overlappedWritesToDelete)
-        {
-            OVERLAPPED *v = pendingOverlappedWrites.takeAt(pendingOverlappedWrites.indexOf(o));
-            pendingOverlappedWrites.removeOne(v);
-            CloseHandle(v->hEvent);
-            delete v;
+            LINEMESSAGE reinit = {};
+            reinit.dwMessageID = LINE_LINEDEVSTATE;
+            reinit.dwParam1 = LINEDEVSTATE_REINIT;
+            route(reinit);
+            break;
         }
+        /* TAPI has just shutdown or the queue is empty */
+        if(ret < 0)
+            break;
 
-        commMutex.unlock();
-        emit bytesWritten(totalBytesWritten);
+        route(lmTapiMessage);
     }
-
-    WaitCommEvent(hCommFile, &receivedEventMask, &overlap);
 }
 
-void TAPIModem::com_readReady()
+void TAPISession::route(const LINEMESSAGE &message)
 {
-    DWORD bytesReturned = 0;
-    qint64 bytesAvailable = 0;
-    char *buff;
+    QMutexLocker locker(&routeMutex);
+    TAPIModem *modem = 0;
 
-    if((bytesAvailable = comBytesAvailable()) > 0)
+    switch(message.dwMessageID)
     {
-#if defined(QT_DEBUG) && defined(QTAPI_DEBUG)
-        qDebug() << "QTapiModem - on_COMevent: Data is ready to be read: " << bytesAvailable << " bytes.";
-#endif
-        /* Create temporary buffer for our data and read it */
-        buff = new char [bytesAvailable];
-        OVERLAPPED overlappedRead;
-        ZeroMemory(&overlappedRead, sizeof(OVERLAPPED));
-        if(!ReadFile(hCommFile, (void *)buff, (DWORD)bytesAvailable, &bytesReturned, &overlappedRead))
+    /* Call messages carry HCALL */
+    case LINE_CALLSTATE:
+    case LINE_CALLINFO:
+    {
+        HCALL call = (HCALL)message.hDevice;
+        modem = calls.value(call);
+        if(!modem)
         {
-            if(GetLastError() == ERROR_IO_PENDING)
-                GetOverlappedResult(hCommFile, &overlappedRead, &bytesReturned, true);
-            else
-            {
-                /* We got an error when reading. Better close connection */
-                hangupCall();
-                errFlag = CommReadError;
-                emit errorOccurred(errFlag);
-            }
+            /* First message of a new call. It belongs to whoever owns its line. */
+            modem = lines.value(callLine(call));
+            if(modem && !(message.dwMessageID == LINE_CALLSTATE && message.dwParam1 == LINECALLSTATE_IDLE))
+                calls.insert(call, modem);
+        }
+        /* Nothing else comes for an idle call. The modem forgets its own one on hangup,
+         * but calls it never took (like offered ones) would stay here forever.
+         */
+        else if(message.dwMessageID == LINE_CALLSTATE && message.dwParam1 == LINECALLSTATE_IDLE)
+            calls.remove(call);
+        break;
+    }
+    /* Replies carry the ID returned by the asynchronous function */
+    case LINE_REPLY:
+        modem = requests.take((DWORD)message.dwParam1);
+        if(!modem)
+        {
+            /* Not registered yet (or nobody cares, like lineDrop()). Keep it for a while.
+             * When there are too many, the oldest ones go, a fresh reply is the likeliest to be claimed.
+             */
+            while(unclaimedReplies.size() >= UNCLAIMED_REPLY_LIMIT && !unclaimedOrder.isEmpty())
+                unclaimedReplies.remove(unclaimedOrder.takeFirst());
+            if(!unclaimedReplies.contains((DWORD)message.dwParam1))
+                unclaimedOrder.append((DWORD)message.dwParam1);
+            unclaimedReplies.insert((DWORD)message.dwParam1, message);
+            return;
+        }
+        break;
+    case LINE_LINEDEVSTATE:
+        /* TAPI wants every application to shutdown, that means every modem */
+        if(message.dwParam1 == LINEDEVSTATE_REINIT)
+        {
+            if(message.dwParam2 == 0)
+                reinitPending.storeRelease(1);
+            for(TAPIModem *m : std::as_const(modems))
+                m->postTAPIMessage(message);
+            return;
         }
+        modem = lines.value((HLINE)message.hDevice);
+        break;
+    /* Line messages carry HLINE */
+    case LINE_CLOSE:
+    case LINE_ADDRESSSTATE:
+        modem = lines.value((HLINE)message.hDevice);
+        break;
+    default:
+        /* LINE_CREATE and others are not for any particular modem */
+        break;
+    }
 
-        /* Now let's insert the data inside our main buffer */
-        modemReadBuffer.append(buff, bytesReturned);
+    if(modem)
+        modem->postTAPIMessage(message);
+}
 
-        /* Release bytesReturned bytes */
-        bufferSem.release(bytesReturned);
+HLINE TAPISession::callLine(HCALL call)
+{
+    HLINE line = 0;
 
-        /* Delete the temporary buffer */
-        delete buff;
+    /* Only the fixed part is needed, the variable one may be cut off */
+    DWORD dwSizeOfCallInfo = sizeof(LINECALLINFO) + 1024;
+    LPLINECALLINFO lpCallInfo = (LPLINECALLINFO)LocalAlloc(LPTR, dwSizeOfCallInfo);
+    lpCallInfo->dwTotalSize = dwSizeOfCallInfo;
+    if(lineGetCallInfo(call, lpCallInfo) == 0)
+        line = lpCallInfo->hLine;
+    LocalFree(lpCallInfo);
 
-        /* Emit readyRead signal */
-        emit readyRead();
-    }
+    return line;
 }
 
 QList<TAPIModemInfo> TAPIModemInfo::availableModems()
 {
     QList<TAPIModemInfo> list;
     LONG ret;
-    HLINEAPP hLineApp;
     DWORD tapiVersion = TAPI_SUPPORTED_API;
-    LPCWSTR appName = (const wchar_t *)TAPI_FRIENDLYNAME;
-    DWORD deviceCount = 0;
 
-    LINEINITIALIZEEXPARAMS lineInit = {};
-    lineInit.dwTotalSize = sizeof(LINEINITIALIZEEXPARAMS);
-    lineInit.dwOptions = LINEINITIALIZEEXOPTION_USEEVENT;
-
-    do
-    {
-        ret = lineInitializeEx(&hLineApp, NULL, NULL, appName, &deviceCount, &tapiVersion, &lineInit);
-        if(ret != 0 && ret != (LONG)LINEERR_REINIT)
-            return list;
-    }
-    while(ret == (LONG)LINEERR_REINIT);
+    /* Use the shared TAPI application, it's already there if any modem is initialized */
+    TAPISession *session = TAPISession::instance();
+    if(!session->acquire(QString(TAPI_FRIENDLYNAME)))
+        return list;
+    HLINEAPP hLineApp = session->lineApp();
+    DWORD deviceCount = session->deviceCount();
 
     LPLINEDEVCAPS lpLineDevCaps = (LPLINEDEVCAPS)LocalAlloc(LPTR, 4096);
     lpLineDevCaps->dwTotalSize = 4096;
@@ -1023,11 +3009,347 @@ QList<TAPIModemInfo> TAPIModemInfo::availableModems()
         list.append(modem);
     }
 
-    lineShutdown(hLineApp);
+    LocalFree(lpLineDevCaps);
+    session->release();
+
+    return list;
+}
+
+TAPIModemPool::TAPIModemPool(QObject *parent) : QObject(parent)
+{
+    /* Lines that failed to initialize don't tell us when they are back, so we have to ask again */
+    retryTimer = new QTimer(this);
+    retryTimer->setSingleShot(true);
+    retryTimer->setInterval(POOL_RETRY_INTERVAL);
+    connect(retryTimer, &QTimer::timeout, this, [this]{ scheduleDispatch(); });
+}
+
+TAPIModemPool::~TAPIModemPool()
+{
+    close();
+}
+
+bool TAPIModemPool::open(const QString &appName)
+{
+    return open(TAPIModemInfo::availableModems(), appName);
+}
+
+bool TAPIModemPool::open(const QList<TAPIModemInfo> &modems, const QString &appName)
+{
+    if(!lines.isEmpty()) return false;
+
+    applicationName = appName;
+    for(const TAPIModemInfo &info : modems)
+    {
+        TAPIModem *modem = new TAPIModem(this);
+        modem->setDeviceId((quint32)info.deviceId());
+        if(!modem->initializeTAPI(appName))
+        {
+#if defined(QT_DEBUG) && defined(QTAPI_DEBUG)
+            qDebug() << "TAPIModemPool - open: skipping modem" << info.deviceId() << "that can't be initialized";
+#endif
+            delete modem;
+            continue;
+        }
+
+        /* Lines stay open between calls, so every call only has to be dialed */
+        modem->setPersistentLine(true);
+
+        /* Line goes back to the pool however the call ends. Queued, so we never redial from inside a hangup. */
+        connect(modem, &TAPIModem::disconnected, this, [this, modem]{ finishLease(modem); }, Qt::QueuedConnection);
+        connect(modem, &TAPIModem::connected, this, [this, modem]{ modemConnected(modem); }, Qt::QueuedConnection);
+        /* Some failures shut TAPI down without a hangup, the line has to come back anyway */
+        connect(modem, &TAPIModem::tapiStateChanged, this, [this, modem](TAPIModem::TAPIState state){ if(state == TAPIModem::Uninitialized) modemShutDown(modem); }, Qt::QueuedConnection);
+
+        PoolLine line;
+        line.modem = modem;
+        lines.append(line);
+    }
+
+    poolClock.start();
+    resetStatistics();
+
+#if defined(QT_DEBUG) && defined(QTAPI_DEBUG)
+    qDebug() << "TAPIModemPool - open: pool opened with" << lines.size() << "lines";
+#endif
+
+    return !lines.isEmpty();
+}
+
+void TAPIModemPool::close()
+{
+    retryTimer->stop();
+    requests.clear();
+
+    /* Deleting modems hangs up their calls and shuts TAPI down */
+    for(const PoolLine &line : std::as_const(lines))
+    {
+        disconnect(line.modem, nullptr, this, nullptr);
+        delete line.modem;
+    }
+    lines.clear();
+}
+
+int TAPIModemPool::dial(const QString &number, QIODevice::OpenMode mode)
+{
+    PoolRequest request;
+    request.id = ++lastRequestId;
+    request.number = number;
+    request.mode = mode;
+    request.queuedTime = poolClock.isValid() ? poolClock.elapsed() : 0;
+    requests.append(request);
+    maximumQueueDepth = qMax(maximumQueueDepth, (int)requests.size());
+
+    scheduleDispatch();
+
+    return request.id;
+}
+
+bool TAPIModemPool::cancel(int requestId)
+{
+    /* Only requests that are still waiting can be cancelled, running calls are ended through their modem */
+    for(qsizetype i = 0; i < requests.size(); i++)
+    {
+        if(requests.at(i).id == requestId)
+        {
+            requests.removeAt(i);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+TAPIModem *TAPIModemPool::modem(int requestId) const
+{
+    for(const PoolLine &line : lines)
+    {
+        if(line.requestId == requestId)
+            return line.modem;
+    }
+
+    return 0;
+}
+
+QList<TAPIModem *> TAPIModemPool::modems() const
+{
+    QList<TAPIModem *> list;
+    for(const PoolLine &line : lines)
+        list.append(line.modem);
 
     return list;
 }
 
+int TAPIModemPool::busyLineCount() const
+{
+    int busy = 0;
+    for(const PoolLine &line : lines)
+    {
+        if(line.requestId)
+            busy++;
+    }
+
+    return busy;
+}
+
+TAPIModemPool::PoolStatistics TAPIModemPool::statistics() const
+{
+    PoolStatistics statistics;
+    qint64 now = poolClock.isValid() ? poolClock.elapsed() : 0;
+
+    /* Lines busy right now count up to this moment */
+    qint64 busy = busyTime;
+    for(const PoolLine &line : lines)
+    {
+        if(line.requestId)
+            busy += now - qMax(line.leasedTime, statisticsStart);
+    }
+
+    statistics.lines = (int)lines.size();
+    statistics.busyLines = busyLineCount();
+    qint64 lineTime = (now - statisticsStart) * lines.size();
+    statistics.utilisation = lineTime > 0 ? (double)busy / lineTime : 0;
+    statistics.queueDepth = (int)requests.size();
+    statistics.maximumQueueDepth = maximumQueueDepth;
+    statistics.callsStarted = callsStarted;
+    statistics.callsFinished = callsFinished;
+    statistics.averageWaitTime = callsStarted > 0 ? (double)totalWaitTime / callsStarted : 0;
+    statistics.maximumWaitTime = maximumWaitTime;
+
+    return statistics;
+}
+
+void TAPIModemPool::resetStatistics()
+{
+    statisticsStart = poolClock.isValid() ? poolClock.elapsed() : 0;
+    busyTime = 0;
+    callsStarted = 0;
+    callsFinished = 0;
+    totalWaitTime = 0;
+    maximumWaitTime = 0;
+    maximumQueueDepth = (int)requests.size();
+}
+
+void TAPIModemPool::scheduleDispatch()
+{
+    /* Signals already queued by the lines are handled first, so a line's old call can't end the new one */
+    if(dispatchPending) return;
+    dispatchPending = true;
+    QMetaObject::invokeMethod(this, [this]{ dispatchRequests(); }, Qt::QueuedConnection);
+}
+
+void TAPIModemPool::dispatchRequests()
+{
+    dispatchPending = false;
+
+    /* Without lines (not opened yet or no modem could be used) the requests would wait forever */
+    if(lines.isEmpty())
+    {
+        QList<PoolRequest> failed;
+        failed.swap(requests);
+        for(const PoolRequest &request : std::as_const(failed))
+        {
+#if defined(QT_DEBUG) && defined(QTAPI_DEBUG)
+            qDebug() << "TAPIModemPool - dispatchRequests: request" << request.id << "failed, the pool has no lines";
+#endif
+            emit requestFinished(request.id, TAPIModem::DisconnectUnavailable, TAPIModem::NoDeviceFoundError);
+        }
+        return;
+    }
+
+    bool retryLines = false;
+
+    /* Lines are looked up by index, slots connected to our signals may change the pool */
+    for(qsizetype i = 0; i < lines.size() && !requests.isEmpty(); i++)
+    {
+        if(lines.at(i).requestId) continue;
+
+        /* Someone else could be using the modem directly, or its last call isn't hung up yet.
+         * Call state can't tell, it keeps the last state TAPI reported after a hangup.
+         */
+        TAPIModem *modem = lines.at(i).modem;
+        if(modem->hasCall())
+            continue;
+
+        /* TAPI could have been shut down under the line (REINIT), try to bring it back */
+        if(modem->tapiState() == TAPIModem::Uninitialized && !modem->initializeTAPI(applicationName))
+        {
+            retryLines = true;
+            continue;
+        }
+
+        PoolRequest request = requests.takeFirst();
+        qint64 now = poolClock.elapsed();
+        qint64 waited = now - request.queuedTime;
+        totalWaitTime += waited;
+        maximumWaitTime = qMax(maximumWaitTime, waited);
+        callsStarted++;
+
+        lines[i].requestId = request.id;
+        lines[i].leasedTime = now;
+
+#if defined(QT_DEBUG) && defined(QTAPI_DEBUG)
+        qDebug() << "TAPIModemPool - dispatchRequests: request" << request.id << "leased modem" << modem << "after" << waited << "ms";
+#endif
+
+        modem->clearError();
+        modem->setDestinationNumber(request.number);
+        modem->connectToNumber(request.mode);
+
+        /* The call couldn't even be started. Some failures don't hang up (or even shut TAPI down),
+         * so the line is returned right here, with what really went wrong.
+         */
+        if(modem->error() != TAPIModem::NoError || !modem->hasCall())
+        {
+            TAPIModem::TAPIError error = modem->error();
+            if(error == TAPIModem::NoError)
+                error = modem->tapiState() == TAPIModem::Uninitialized ? TAPIModem::InitError : TAPIModem::CallMakeError;
+
+#if defined(QT_DEBUG) && defined(QTAPI_DEBUG)
+            qDebug() << "TAPIModemPool - dispatchRequests: request" << request.id << "failed to dial, error" << error;
+#endif
+            modem->endConnection();
+            endLease(lines[i], TAPIModem::DisconnectUnavailable, error);
+            retryLines = true;
+            continue;
+        }
+
+        emit lineLeased(request.id, modem);
+    }
+
+    /* Hangups bring us back for busy lines, but nothing does for the broken ones */
+    if(retryLines && !requests.isEmpty())
+        retryTimer->start();
+}
+
+void TAPIModemPool::finishLease(TAPIModem *modem)
+{
+    for(PoolLine &line : lines)
+    {
+        if(line.modem != modem) continue;
+
+        /* Modems also report hangups of lines that weren't leased. The line may be free for the queue now. */
+        if(!line.requestId) break;
+
+        /* Stray report, e.g. queued from the previous call or from a line event. The leased call is still up. */
+        if(modem->hasCall())
+        {
+#if defined(QT_DEBUG) && defined(QTAPI_DEBUG)
+            qDebug() << "TAPIModemPool - finishLease: ignoring disconnect of modem" << modem << "with a call in progress";
+#endif
+            return;
+        }
+
+        endLease(line, modem->disconnectReason(), modem->error());
+        break;
+    }
+
+    if(!requests.isEmpty())
+        scheduleDispatch();
+}
+
+void TAPIModemPool::endLease(PoolLine &line, TAPIModem::DisconnectReason reason, TAPIModem::TAPIError error)
+{
+    int requestId = line.requestId;
+    qint64 now = poolClock.elapsed();
+    busyTime += now - qMax(line.leasedTime, statisticsStart);
+    callsFinished++;
+    line.requestId = 0;
+
+    emit requestFinished(requestId, reason, error);
+}
+
+void TAPIModemPool::modemShutDown(TAPIModem *modem)
+{
+    for(PoolLine &line : lines)
+    {
+        /* A hangup before the shutdown has returned the line already */
+        if(line.modem != modem || !line.requestId) continue;
+
+#if defined(QT_DEBUG) && defined(QTAPI_DEBUG)
+        qDebug() << "TAPIModemPool - modemShutDown: TAPI of modem" << modem << "shut down during a lease";
+#endif
+        endLease(line, modem->disconnectReason(), modem->error());
+        break;
+    }
+
+    /* Lines without TAPI are brought back by the retry */
+    if(!requests.isEmpty())
+        retryTimer->start();
+}
+
+void TAPIModemPool::modemConnected(TAPIModem *modem)
+{
+    for(const PoolLine &line : std::as_const(lines))
+    {
+        if(line.modem == modem && line.requestId)
+        {
+            emit requestConnected(line.requestId, modem);
+            return;
+        }
+    }
+}
+
 DialableNumberBuilder::DialableNumberBuilder()
 {
 }
@@ -1062,4 +3384,3 @@ QString DialableNumberBuilder::Build()
 {
     return _dialableNumber;
 }
-
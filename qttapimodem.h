@@ -7,15 +7,30 @@
 #define QTTAPIMODEM_H
 
 #include "qttapimodem_global.h"
+#include "qttapimodembuffer.h"
 
 #include <QIODevice>
 #include <QMutex>
 #include <QTimer>
-#include <QSemaphore>
+#include <QElapsedTimer>
+#include <QDeadlineTimer>
+#include <QAtomicInteger>
+#include <QAtomicPointer>
 #include <QList>
-#include <QEventLoop>
+#include <QHash>
+#include <QWaitCondition>
 #include <QWinEventNotifier>
+#include <QThread>
 #include <QString>
+#include <QByteArray>
+#include <QByteArrayView>
+#include <QMetaType>
+
+#include <type_traits>
+
+#if __cplusplus >= 202002L || (defined(_MSVC_LANG) && _MSVC_LANG >= 202002L)
+#include <span>
+#endif
 
 #include <windows.h>
 #include <tapi.h>
@@ -25,6 +40,8 @@ static constexpr DWORD TAPI_SUPPORTED_API           = 0x00020002;
 /* Friendly name for our application */
 static constexpr const char *TAPI_FRIENDLYNAME      = "QtTapiModem";
 
+class TAPIModemStatus;
+
 /* Main TAPI Modem class
  *
  * Based on some implementations, mainly Microsoft's TAPICOMM example
@@ -41,6 +58,16 @@ static constexpr const char *TAPI_FRIENDLYNAME      = "QtTapiModem";
  * Errors are only for TAPI and IO operations - not what is happening on the line.
  * For this you need to listen for call and line state changes.
  *
+ * With setIoThreadEnabled() all TAPI and COM port events are handled
+ * on an internal worker thread, so a busy owner thread can't delay
+ * them. Received data is handed over through the lock-free receive
+ * buffer and signals are queued to the owner thread in order.
+ *
+ * The device is opened with the mode passed to connectToNumber() once
+ * the call connects. Unbuffered mode is recommended for high throughput,
+ * because read() then copies straight from our receive buffer to the
+ * caller instead of going through QIODevice's buffer as well.
+ *
  */
 class QTM_EXPORT TAPIModem : public QIODevice
 {
@@ -75,74 +102,373 @@ public:
     Q_FLAG(LineState)
     Q_DECLARE_FLAGS(LineStates, LineState)
 
+    enum WritePriority {ControlPriority = 0x00, NormalPriority = 0x01, BulkPriority = 0x02};
+    Q_FLAG(WritePriority)
+    Q_DECLARE_FLAGS(WritePriorities, WritePriority)
+
+    enum ReadProfile {LowLatencyProfile = 0x00, BalancedProfile = 0x01, BulkProfile = 0x02, CustomProfile = 0xFF};
+    Q_FLAG(ReadProfile)
+    Q_DECLARE_FLAGS(ReadProfiles, ReadProfile)
+
+    /* When readyRead() gets emitted
+     *
+     * The signal is emitted when at least minimumBytes are waiting
+     * to be read or when newly received data contains the delimiter
+     * byte (-1 disables it). Data that didn't meet any of those is
+     * signaled anyway after maximumDelay miliseconds (0 means on the
+     * next event loop pass, negative means never).
+     *
+     * Default policy signals every received piece of data right away.
+     */
+    struct ReadNotificationPolicy
+    {
+        qint64 minimumBytes = 1;
+        int maximumDelay = 0;
+        int delimiter = -1;
+    };
+
+    /* Settings behind a read profile
+     *
+     * Timeouts are passed to SetCommTimeouts, queue sizes to SetupComm
+     * and the event mask to SetCommMask. EV_RXCHAR is always added
+     * to the mask, because we can't work without it.
+     *
+     * readBatchInterval is how long (in miliseconds) we let the data
+     * gather in the driver queue after handling a receive event, before
+     * we read it and wait for the next event. Zero means we are waiting
+     * again right away.
+     */
+    struct ReadProfileSettings
+    {
+        quint32 readIntervalTimeout = 250;
+        quint32 readTotalTimeoutMultiplier = 0;
+        quint32 readTotalTimeoutConstant = 0;
+        quint32 inputQueueSize = 4096;
+        quint32 outputQueueSize = 4096;
+        quint32 eventMask = EV_RXCHAR;
+        int readBatchInterval = 0;
+    };
+
+    /* Statistics of one write priority queue
+     *
+     * Bytes are counted when queued and when the modem finished sending
+     * them. Queue delay is the time (in miliseconds) the oldest byte of a
+     * queued chunk waited before it was handed to the driver.
+     */
+    struct WriteQueueStatistics
+    {
+        qint64 bytesQueued = 0;
+        qint64 bytesWritten = 0;
+        qint64 bytesPending = 0;
+        double averageQueueDelay = 0;
+        qint64 maximumQueueDelay = 0;
+    };
+
+    /* TAPI message dispatch diagnostics. Times are in microseconds. */
+    struct TAPIDispatchStatistics
+    {
+        qint64 activations = 0;
+        qint64 emptyActivations = 0;
+        qint64 messages = 0;
+        int maximumMessages = 0;
+        double averageHandlingTime = 0;
+        qint64 maximumHandlingTime = 0;
+    };
+
     TAPIModem(QObject *parent = 0);
     virtual ~TAPIModem();
 
+    bool setIoThreadEnabled(bool enabled);
+    bool ioThreadEnabled() const { return ioThread != 0; }
+
     //bool open(QIODevice::OpenMode mode = QIODevice::ReadWrite); // We don't need open() to be honest. TAPI is more of a mix between QTcpSocket and QSerialPort
     bool initializeTAPI();
     bool initializeTAPI(QString appName);
-    void connectToNumber(quint32 modemId, QString destNumber);
-    void connectToNumber();
+    void connectToNumber(quint32 modemId, QString destNumber, OpenMode mode = ReadWrite);
+    void connectToNumber(OpenMode mode = ReadWrite);
     void endConnection();
+    bool disconnectFromNumber(int msecs = 30000);
 
     bool isSequential() const { return true; }
     qint64 bytesAvailable() const;
+    bool canReadLine() const;
+    QByteArray readUntil(QByteArrayView delimiter);
+
+    QList<QByteArrayView> peekSpans();
+    qint64 consume(qint64 len);
+    QList<QByteArray> readAllShared();
 
     bool waitForReadyRead(int msecs = 30000);
     bool waitForConnected(int msecs = 30000);
     bool waitForDisconnected(int msecs = 30000);
+    bool waitForBytesWritten(int msecs = 30000);
+
+    void setReadProfile(ReadProfile profile);
+    void setReadProfile(const ReadProfileSettings &settings);
+    ReadProfile readProfile() const;
+    ReadProfileSettings readProfileSettings() const;
+    static ReadProfileSettings readProfilePreset(ReadProfile profile);
+
+    void setReadBufferSize(qint64 size);
+    qint64 readBufferSize() const { return readBufferLimit.loadAcquire(); }
+    void setReadBufferLowWaterMark(qint64 size);
+    qint64 readBufferLowWaterMark() const;
+
+    void setReadNotificationPolicy(const ReadNotificationPolicy &policy);
+    ReadNotificationPolicy readNotificationPolicy() const;
+
+    void setAdaptiveReadBatching(bool enabled, int targetLatency = 10);
+    bool adaptiveReadBatching() const;
+    double inboundByteRate() const;
+
+    using QIODevice::write;
+    qint64 write(const QByteArray &data);
+    qint64 write(const QByteArray &data, WritePriority priority);
+    qint64 writeV(const QList<QByteArrayView> &pieces, WritePriority priority = NormalPriority);
+#if defined(__cpp_lib_span)
+    /* Inline, the library itself may be built without C++20 */
+    qint64 writeV(std::span<const QByteArrayView> pieces, WritePriority priority = NormalPriority)
+    { return writePieces(pieces.data(), (qsizetype)pieces.size(), priority); }
+#endif
+    qint64 bytesToWrite() const;
+    bool flush();
+    void setWriteCoalescingDelay(int msecs);
+    int writeCoalescingDelay() const;
+    void setWriteBufferHighWaterMark(qint64 size);
+    qint64 writeBufferHighWaterMark() const;
+
+    void setMaximumWritesInFlight(int count);
+    int maximumWritesInFlight() const;
+    int writesInFlight() const;
+    int peakWritesInFlight() const;
+    int writeRequestPoolSize() const;
+
+    quint32 lineRate() const;
+    void setTransmitPacing(int lineTimeMsecs);
+    int transmitPacing() const;
+    qint64 writeUrgent(QByteArrayView data);
+
+    void setStrictWritePriority(bool strict);
+    bool strictWritePriority() const;
+    void setWritePriorityWeight(WritePriority priority, int weight);
+    int writePriorityWeight(WritePriority priority) const;
+    WriteQueueStatistics writeQueueStatistics(WritePriority priority) const;
+    void resetWriteQueueStatistics();
+
+    TAPIDispatchStatistics tapiDispatchStatistics() const;
+    void resetTapiDispatchStatistics();
 
     void setDeviceId(quint32 deviceId) { dwDeviceId = (DWORD)deviceId; }
+    void setPersistentLine(bool enabled);
+    bool persistentLine() const;
+    void releaseLine();
     void setFriendlyName(QString name) { friendlyName = name; }
     void setDestinationNumber(QString number) { destinationNumber = number; }
 
-    TAPIError error() { return errFlag; }
-    void clearError() { errFlag = NoError; }
+    TAPIError error() const;
+    void clearError();
+
+    TAPIState tapiState() const;
+    CallState callState() const;
+    bool hasCall() const;
+    DisconnectReason disconnectReason() const;
+    LineState lineState() const;
 
-    TAPIState tapiState() { return tapiStateFlag; }
-    CallState callState() { return callStateFlag; }
-    DisconnectReason disconnectReason() { return disconnectFlag; }
-    LineState lineState() { return lineStateFlag; }
+    TAPIModemStatus status() const;
 
 private:
+    /* I/O worker thread. Notifiers and timers live on ioContext, which is moved to the thread */
+    QThread * ioThread = 0;
+    QObject * ioContext = 0;
+
+    QObject *ioObject() { return ioContext ? ioContext : this; }
+    bool inIoThread() const { return !ioThread || QThread::currentThread() == ioThread; }
+    /* Thread that runs our notifiers and timers, the owner thread without the I/O thread */
+    bool inEventThread() const { return QThread::currentThread() == (ioThread ? ioThread : thread()); }
+
+    /* Blocking waits. Every event a waitFor* function can wait for has a counter,
+     * bumped after the event is signaled. Threads other than the one handling
+     * events sleep on the condition until the counter moves.
+     */
+    enum WaitEvent {WaitReadyRead = 0, WaitConnected = 1, WaitDisconnected = 2, WaitBytesWritten = 3};
+    static constexpr int WaitEventCount = 4;
+    QAtomicInteger<quint32> waitEvents[WaitEventCount];
+    QAtomicInteger<int> waitingThreads = 0;
+    QAtomicInteger<int> deviceOpenPending = 0;
+    QMutex waitMutex;
+    QWaitCondition waitCondition;
+
+    bool waitForModemEvent(WaitEvent event, quint32 since, int msecs);
+    void signalWaiters(WaitEvent event);
+    qint64 dispatchDueTimers();
+
+    /* Calls the function on the I/O thread and waits for its result */
+    template <typename Function>
+    auto callInIoThread(Function function) const
+    {
+        using Result = decltype(function());
+        if constexpr (std::is_void_v<Result>)
+        {
+            QMetaObject::invokeMethod(ioContext, function, Qt::BlockingQueuedConnection);
+        }
+        else
+        {
+            Result result{};
+            QMetaObject::invokeMethod(ioContext, function, Qt::BlockingQueuedConnection, &result);
+            return result;
+        }
+    }
+
     /* General variables */
     QString friendlyName = QString(TAPI_FRIENDLYNAME);
-    TAPIError errFlag = NoError;
-    TAPIState tapiStateFlag = Uninitialized;
-    CallState callStateFlag = CallDefaultState;
-    DisconnectReason disconnectFlag = DisconnectDefaultState;
-    LineState lineStateFlag = LineClosed;
 
-    /* Initialization variables */
+    /* Published state, readable from any thread. All state flags are packed in one word
+     * (see TAPIModemStatus), so single getters need just one load. Everything below is
+     * written under a seqlock, so status() sees the word, counters and timestamps together.
+     */
+    QMutex statusWriteMutex;
+    QAtomicInteger<quint32> statusSeqlock = 0;
+    QAtomicInteger<quint64> statusWord = 0;
+    QAtomicInteger<qint64> statusBytesReceived = 0;
+    QAtomicInteger<qint64> statusBytesWritten = 0;
+    QAtomicInteger<qint64> statusConnectedTime = 0;
+    QAtomicInteger<qint64> statusReceiveTime = 0;
+    QAtomicInteger<qint64> statusWriteTime = 0;
+    QAtomicInteger<qint64> statusChangeTime = 0;
+    QAtomicInteger<int> statusChangePending = 0;
+
+    /* Initialization variables. TAPI application is shared by all modems, see TAPISession */
     HLINEAPP hLineApp = 0;
     DWORD dwDeviceNumber;
 
-    QMutex lineAppMutex;
+    /* Messages routed to us by the session, waiting to be handled on our thread */
+    friend class TAPISession;
+    QMutex tapiInboxMutex;
+    QList<LINEMESSAGE> tapiInbox;
+    HANDLE tapiInboxEvent = 0;
     QWinEventNotifier * tapiEventNotifier = 0;
+    TAPIDispatchStatistics dispatchStatistics;
+    qint64 dispatchTotalTime = 0;
 
     /* Call specific variables */
     HCALL hcCurrentCall = 0;
     QString destinationNumber;
+    OpenMode connectOpenMode = ReadWrite;
 
     QMutex callMutex;
 
-    /* Device/Line specific variables */
+    /* Device/Line specific variables. A persistent line keeps its handle and API version between calls */
     HLINE hlDevice = 0;
     DWORD dwDeviceId = 0;
+    DWORD lineDeviceId = 0;
+    DWORD lineApiVersion = 0;
+    bool persistentLineMode = false;
+    bool lineReleaseRequested = false;
 
     QMutex lineMutex;
 
     /* Data communication specific variables */
     HANDLE hCommFile = INVALID_HANDLE_VALUE;
-    OVERLAPPED overlap;
+    OVERLAPPED overlap = {};
     DWORD receivedEventMask;
-    QList<OVERLAPPED *> pendingOverlappedWrites;
+
+    /* Write handed to the driver. Data is kept alive until the write completes.
+     * Requests and their events are created once and reused for every write and call.
+     */
+    struct WriteRequest
+    {
+        OVERLAPPED overlapped;
+        QByteArray data;
+        qint64 offset = 0;
+        qint64 length = 0;
+        int priority = NormalPriority;
+    };
+    QList<WriteRequest *> writeRequestPool;
+    QList<WriteRequest *> freeWriteRequests;
+    QList<WriteRequest *> pendingWrites;
+    QWinEventNotifier * writeCompletionNotifier = 0;
+    int writesInFlightLimit = 2;
+    int writesInFlightPeak = 0;
+
+    /* Outbound queue. Small writes are appended to the last chunk, so they go out in one WriteFile.
+     * Large QByteArrays are queued as they are, sharing the data with the caller.
+     * Chunk at the front can be partly handed to the driver already.
+     */
+    struct OutboundChunk
+    {
+        QByteArray data;
+        qint64 queuedTime = 0;
+    };
+    struct OutboundQueue
+    {
+        QList<OutboundChunk> chunks;
+        qint64 headOffset = 0;
+        qint64 bytes = 0;
+
+        /* Weighted scheduling and statistics */
+        int weight = 1;
+        int currentWeight = 0;
+        qint64 bytesQueued = 0;
+        qint64 bytesWritten = 0;
+        qint64 delaySamples = 0;
+        qint64 totalQueueDelay = 0;
+        qint64 maximumQueueDelay = 0;
+    };
+    static constexpr int WritePriorityCount = 3;
+    OutboundQueue outboundQueues[WritePriorityCount];
+    bool strictPriority = true;
+    qint64 pendingWriteBytes = 0;
+    qint64 writeHighWaterMark = 0;
+    bool writeBufferAboveMark = false;
+    int coalescingDelay = 0;
+    QTimer * writeCoalescingTimer = 0;
+
+    /* Transmit pacing. Data is handed to the driver at the line rate, at most transmitPacingTime ahead of it */
+    quint32 lineRateBps = 0;
+    int transmitPacingTime = 0;
+    double paceCredit = 0;
+    qint64 paceRefillTime = 0;
+    QElapsedTimer writeClock;
+    QTimer * transmitPaceTimer = 0;
 
     QWinEventNotifier * commIOEventNotifier = 0;
+    QTimer * readBatchTimer = 0;
     QMutex commMutex;
 
-    QSemaphore bufferSem;
-    QByteArray modemReadBuffer;
+    ReadProfile readProfileFlag = BalancedProfile;
+    ReadProfileSettings readSettings;
+
+    /* readyRead() coalescing */
+    ReadNotificationPolicy notificationPolicy;
+
+    /* Adaptive read batching */
+    bool adaptiveBatching = false;
+    int adaptiveTargetLatency = 10;
+    int adaptiveBatchInterval = 0;
+    qint64 adaptiveReadyReadThreshold = 1;
+    QElapsedTimer rateClock;
+    TAPIModemRateEstimator inboundRate;
+    QTimer * readyReadFlushTimer = 0;
+
+    TAPIModemBuffer modemReadBuffer;
+
+    /* Receive buffer limits. When paused we don't read and the modem is told to stop sending.
+     * Set in the I/O thread, but the reader checks them when it makes room.
+     */
+    QAtomicInteger<qint64> readBufferLimit = 0;
+    QAtomicInteger<qint64> readBufferResumeLimit = -1;
+    QAtomicInteger<int> receivePaused = 0;
+    bool commRtsHandshake = false;
+    bool commRtsCleared = false;
+
+    /* Where the last delimiter search stopped, so we don't scan the same data twice */
+    mutable QByteArray scanDelimiter;
+    mutable qint64 scanPosition = 0;
+
+    /* Copy of QIODevice's own buffer, for peekSpans(). Kept until that buffer is empty
+     * or refilled, so views handed out earlier stay valid like the ones into our own buffer.
+     */
+    QByteArray deviceBufferCopy;
 
 public slots:
     void close();
@@ -152,9 +478,49 @@ private slots:
     void on_COMevent();
 
     void com_readReady();
+    void com_readBatchTimeout();
+    void com_readyReadFlush();
+    void com_resumeReceiving();
+    void com_writeCoalescingTimeout();
+    void com_writeCompleted();
 
 private:
+    void postTAPIMessage(const LINEMESSAGE &lmTapiMessage);
+    void handleTAPIMessage(const LINEMESSAGE &lmTapiMessage);
     void initializeCommPort();
+    void openDevice();
+    void applyReadProfile();
+    void waitForCommEvent();
+    void retuneReadBatching();
+    void pauseReceiving();
+    void notifyReadyRead(bool delimiterReceived);
+    void enqueueWrite(WritePriority priority, const char *data, qint64 len);
+    void enqueueWrite(WritePriority priority, const QByteArray &data);
+    qint64 queuedWriteBytes() const;
+    int nextWritePriority() const;
+    void commitWritePriority(int priority);
+    qint64 transmitPaceBudget() const;
+    void refillPaceCredit();
+    quint32 queryLineRate();
+    qint64 writePieces(const QByteArrayView *pieces, qsizetype count, WritePriority priority);
+    void updateWriteBufferLevel();
+    bool startNextWrite(bool force);
+    WriteRequest *acquireWriteRequest();
+    void releaseWriteRequest(WriteRequest *request);
+    void watchWriteCompletion();
+
+    void setError(TAPIError error);
+    void setTapiState(TAPIState state);
+    void setCallState(CallState state);
+    void setLineState(LineState state);
+    void setDisconnectReason(DisconnectReason reason);
+    void beginStatusWrite();
+    void endStatusWrite();
+    bool storeStatus(int shift, quint8 value);
+    void publishStatus();
+    bool updateStatus(int shift, quint8 value);
+    void countReceived(qint64 bytes);
+    void countWritten(qint64 bytes);
 
     void deinitializeTAPI();
     void shutdownTAPI();
@@ -163,8 +529,13 @@ private:
 
     qint64 comBytesAvailable();
 
+    qint64 findDelimiter(QByteArrayView delimiter) const;
+    qint64 readReceived(char *data, qint64 maxlen);
+    void receivedConsumed(qint64 len);
+
 protected:
     qint64 readData(char *data, qint64 maxlen);
+    qint64 readLineData(char *data, qint64 maxlen);
     qint64 writeData(const char *data, qint64 len);
 
 signals:
@@ -177,10 +548,140 @@ signals:
     void connected();
     void disconnected();
 
+    void statusChanged(TAPIModemStatus);
+
+    void receiveBufferFull();
+    void writeBufferFull();
+
     /* Private signals */
     void lineReplyOccured(QPrivateSignal, LONG request, LONG reply);
 };
 
+/* Snapshot of the modem state
+ *
+ * Returned by TAPIModem::status() and carried by statusChanged().
+ * It can be taken from any thread without locking. The state flags,
+ * byte counters and timestamps are copied under a seqlock, so they
+ * always belong to the same moment.
+ *
+ * Timestamps are in miliseconds since the epoch, 0 means never.
+ * sequence() grows with every state change, so a poller can tell
+ * if anything changed since the last time.
+ *
+ */
+class QTM_EXPORT TAPIModemStatus
+{
+public:
+    TAPIModem::TAPIState tapiState() const { return (TAPIModem::TAPIState)field(TapiStateShift); }
+    TAPIModem::CallState callState() const { return (TAPIModem::CallState)field(CallStateShift); }
+    TAPIModem::LineState lineState() const { return (TAPIModem::LineState)field(LineStateShift); }
+    TAPIModem::TAPIError error() const { return (TAPIModem::TAPIError)field(ErrorShift); }
+    TAPIModem::DisconnectReason disconnectReason() const { return (TAPIModem::DisconnectReason)field(DisconnectReasonShift); }
+    quint32 sequence() const { return (quint32)(state >> SequenceShift); }
+
+    qint64 bytesReceived() const { return received; }
+    qint64 bytesWritten() const { return written; }
+
+    qint64 connectedTime() const { return connectedAt; }
+    qint64 lastReceiveTime() const { return receivedAt; }
+    qint64 lastWriteTime() const { return writtenAt; }
+    qint64 lastChangeTime() const { return changedAt; }
+
+private:
+    friend class TAPIModem;
+
+    /* Layout of the state word */
+    static constexpr int TapiStateShift = 0;
+    static constexpr int CallStateShift = 8;
+    static constexpr int LineStateShift = 16;
+    static constexpr int ErrorShift = 24;
+    static constexpr int DisconnectReasonShift = 32;
+    static constexpr int SequenceShift = 40;
+
+    quint8 field(int shift) const { return (quint8)(state >> shift); }
+
+    quint64 state = 0;
+    qint64 received = 0;
+    qint64 written = 0;
+    qint64 connectedAt = 0;
+    qint64 receivedAt = 0;
+    qint64 writtenAt = 0;
+    qint64 changedAt = 0;
+};
+
+Q_DECLARE_METATYPE(TAPIModemStatus)
+
+/* Process-wide TAPI application
+ *
+ * TAPI is initialized once per process, no matter how many modems
+ * are used. Every TAPIModem acquires the session when it initializes
+ * TAPI and releases it when it shuts TAPI down. The first acquire
+ * calls lineInitializeEx() (with the name given by that modem), the
+ * last release calls lineShutdown().
+ *
+ * All TAPI messages are taken by one pump running on its own thread.
+ * Each message is routed to the modem it belongs to through hash maps
+ * keyed by HLINE, HCALL or asynchronous request ID and is queued in
+ * that modem's inbox. Modems handle their messages on their own
+ * thread, as before. Calls are added to the map when their first
+ * message arrives, so a modem only registers its line and requests.
+ *
+ * A reply can come before its request is registered. Such replies are
+ * kept (up to a limit) and handed over when the request shows up.
+ *
+ * When TAPI asks for reinitialization, every modem is told to shut
+ * TAPI down. acquire() fails until all of them have released the
+ * session, then the next one initializes TAPI again from scratch.
+ *
+ */
+class QTM_EXPORT TAPISession
+{
+public:
+    static TAPISession *instance();
+
+    bool acquire(const QString &appName, TAPIModem *modem = 0);
+    void release(TAPIModem *modem = 0);
+
+    HLINEAPP lineApp() const { return hLineApp; }
+    DWORD deviceCount() const { return dwDeviceNumber; }
+
+    void registerLine(HLINE line, TAPIModem *modem);
+    void unregisterLine(HLINE line);
+    void unregisterCall(HCALL call);
+    void registerRequest(LONG requestId, TAPIModem *modem);
+
+private:
+    TAPISession() = default;
+    Q_DISABLE_COPY(TAPISession)
+
+    void on_TAPIevent();
+    void route(const LINEMESSAGE &message);
+    HLINE callLine(HCALL call);
+
+    /* Initialization, guarded by lifecycleMutex */
+    QMutex lifecycleMutex;
+    int userCount = 0;
+    HLINEAPP hLineApp = 0;
+    DWORD dwDeviceNumber = 0;
+
+    /* Set by REINIT, cleared when the last user leaves */
+    QAtomicInteger<int> reinitPending = 0;
+
+    /* Event pump */
+    QThread * pumpThread = 0;
+    QObject * pumpContext = 0;
+    QWinEventNotifier * pumpNotifier = 0;
+
+    /* Routing, guarded by routeMutex */
+    QMutex routeMutex;
+    QList<TAPIModem *> modems;
+    QHash<HLINE, TAPIModem *> lines;
+    QHash<HCALL, TAPIModem *> calls;
+    QHash<DWORD, TAPIModem *> requests;
+    QHash<DWORD, LINEMESSAGE> unclaimedReplies;
+    QList<DWORD> unclaimedOrder;
+};
+
 /* Info class for modems
  * Similar to QSerialPortInfo class
  *
@@ -204,6 +705,106 @@ private:
     QString name;
 };
 
+/* Bank of modems sharing the dialing work
+ *
+ * The pool takes every modem found by TAPIModemInfo (or the ones
+ * you give it), keeps a TAPIModem with TAPI initialized and a
+ * persistent line for each of them and leases a free one to every
+ * dial() request. When all lines
+ * are busy, requests wait in a queue and are served in order as soon
+ * as a line hangs up. A line is returned to the pool when its modem
+ * emits disconnected(), however the call ended.
+ *
+ * Requests are started from the event loop, never straight from
+ * dial(), so signals of the previous call on a line are always
+ * handled before the line gets a new one.
+ *
+ * The pool belongs to the thread it was created in and must be used
+ * from there. Statistics times are in miliseconds.
+ *
+ */
+class QTM_EXPORT TAPIModemPool : public QObject
+{
+    Q_OBJECT
+
+public:
+    struct PoolStatistics
+    {
+        int lines = 0;
+        int busyLines = 0;
+        double utilisation = 0;
+        int queueDepth = 0;
+        int maximumQueueDepth = 0;
+        qint64 callsStarted = 0;
+        qint64 callsFinished = 0;
+        double averageWaitTime = 0;
+        qint64 maximumWaitTime = 0;
+    };
+
+    explicit TAPIModemPool(QObject *parent = 0);
+    virtual ~TAPIModemPool();
+
+    bool open(const QString &appName = QString(TAPI_FRIENDLYNAME));
+    bool open(const QList<TAPIModemInfo> &modems, const QString &appName = QString(TAPI_FRIENDLYNAME));
+    void close();
+
+    int dial(const QString &number, QIODevice::OpenMode mode = QIODevice::ReadWrite);
+    bool cancel(int requestId);
+    TAPIModem *modem(int requestId) const;
+
+    QList<TAPIModem *> modems() const;
+    int lineCount() const { return (int)lines.size(); }
+    int busyLineCount() const;
+    int queuedRequests() const { return (int)requests.size(); }
+
+    PoolStatistics statistics() const;
+    void resetStatistics();
+
+signals:
+    void lineLeased(int requestId, TAPIModem *modem);
+    void requestConnected(int requestId, TAPIModem *modem);
+    void requestFinished(int requestId, TAPIModem::DisconnectReason reason, TAPIModem::TAPIError error);
+
+private:
+    struct PoolLine
+    {
+        TAPIModem *modem = 0;
+        int requestId = 0;
+        qint64 leasedTime = 0;
+    };
+    struct PoolRequest
+    {
+        int id = 0;
+        QString number;
+        QIODevice::OpenMode mode = QIODevice::ReadWrite;
+        qint64 queuedTime = 0;
+    };
+
+    QString applicationName;
+    QList<PoolLine> lines;
+    QList<PoolRequest> requests;
+    int lastRequestId = 0;
+    bool dispatchPending = false;
+    QTimer * retryTimer = 0;
+
+    /* Statistics */
+    QElapsedTimer poolClock;
+    qint64 statisticsStart = 0;
+    qint64 busyTime = 0;
+    qint64 callsStarted = 0;
+    qint64 callsFinished = 0;
+    qint64 totalWaitTime = 0;
+    qint64 maximumWaitTime = 0;
+    int maximumQueueDepth = 0;
+
+    void scheduleDispatch();
+    void dispatchRequests();
+    void finishLease(TAPIModem *modem);
+    void endLease(PoolLine &line, TAPIModem::DisconnectReason reason, TAPIModem::TAPIError error);
+    void modemShutDown(TAPIModem *modem);
+    void modemConnected(TAPIModem *modem);
+};
+
 /* Simple class for building dialable numbers
  *
  * Using it, we can quickly build a number in
@@ -0,0 +1,445 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Pieszka
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "qttapimodembuffer.h"
+
+#include <cstring>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define QTM_SCAN_AVX2
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define QTM_SCAN_SSE2
+#endif
+
+/* Returns index of the first c in data, or -1 */
+static qint64 findByte(const char *data, qint64 len, char c)
+{
+    qint64 i = 0;
+
+#if defined(QTM_SCAN_AVX2)
+    const __m256i needle32 = _mm256_set1_epi8(c);
+    for(; i + 32 <= len; i += 32)
+    {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(data + i));
+        uint mask = (uint)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle32));
+        if(mask)
+            return i + qCountTrailingZeroBits(mask);
+    }
+#endif
+#if defined(QTM_SCAN_SSE2)
+    const __m128i needle16 = _mm_set1_epi8(c);
+    for(; i + 16 <= len; i += 16)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(data + i));
+        uint mask = (uint)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle16));
+        if(mask)
+            return i + qCountTrailingZeroBits(mask);
+    }
+#endif
+
+    /* Whatever is left, or everything without SIMD */
+    for(; i < len; i++)
+        if(data[i] == c)
+            return i;
+
+    return -1;
+}
+
+TAPIModemBuffer::TAPIModemBuffer(qint64 blockSize) : blockLength(qMax<qint64>(blockSize, 64))
+{
+    /* There is always at least one block, shared by both sides when the buffer is empty */
+    writeBlock = readBlock = oldestBlock = knownConsumerBlock = allocateBlock();
+    consumerBlock.storeRelaxed(readBlock);
+}
+
+TAPIModemBuffer::~TAPIModemBuffer()
+{
+    /* All blocks are chained starting from the oldest one */
+    Block *block = oldestBlock;
+    while(block)
+    {
+        Block *next = block->next.loadRelaxed();
+        delete block;
+        block = next;
+    }
+}
+
+void TAPIModemBuffer::append(const char *data, qint64 len)
+{
+    while(len > 0)
+    {
+        qint64 n = 0;
+        char *space = reserve(len, &n);
+        memcpy(space, data, (size_t)n);
+        commit(n);
+        data += n;
+        len -= n;
+    }
+}
+
+char *TAPIModemBuffer::reserve(qint64 maxlen, qint64 *reserved)
+{
+    /* Start a new block if there is no room left in the current one.
+     * The consumer can't move past a full block until we link the next one.
+     */
+    if(writeOffset == blockLength)
+    {
+        Block *block = nextWriteBlock();
+        writeBlock->next.storeRelease(block);
+        writeBlock = block;
+        writeOffset = 0;
+    }
+
+    /* Hand out the contiguous free space of the current block */
+    *reserved = qBound<qint64>(0, maxlen, blockLength - writeOffset);
+    return writeBlock->data + writeOffset;
+}
+
+void TAPIModemBuffer::commit(qint64 len)
+{
+    if(len <= 0) return;
+
+    /* Only the space handed out by the last reserve() can be committed */
+    writeOffset = qMin(writeOffset + len, blockLength);
+
+    /* Publish the data. Everything written before is visible to the consumer after this */
+    tailIndex.storeRelease(tailIndex.loadRelaxed() + len);
+}
+
+qint64 TAPIModemBuffer::read(char *data, qint64 maxlen)
+{
+    qint64 n = peek(data, maxlen);
+    return skip(n);
+}
+
+qint64 TAPIModemBuffer::peek(char *data, qint64 maxlen, qint64 offset) const
+{
+    qint64 available = tailIndex.loadAcquire() - headIndex.loadRelaxed();
+    if(offset < 0 || offset >= available || maxlen <= 0) return 0;
+
+    qint64 copied = 0;
+    qint64 left = qMin(maxlen, available - offset);
+    qint64 position = readOffset + offset;
+    Block *block = readBlock;
+
+    /* Every block but the last one is full, so finding the first requested byte is simple */
+    while(position >= blockLength)
+    {
+        position -= blockLength;
+        block = block->next.loadAcquire();
+    }
+
+    /* And copy block ranges until we are done */
+    while(left > 0)
+    {
+        qint64 n = qMin(left, blockLength - position);
+        memcpy(data + copied, block->data + position, (size_t)n);
+        copied += n;
+        left -= n;
+        position = 0;
+        if(left > 0)
+            block = block->next.loadAcquire();
+    }
+
+    return copied;
+}
+
+qint64 TAPIModemBuffer::skip(qint64 len)
+{
+    qint64 head = headIndex.loadRelaxed();
+    qint64 skipped = qBound<qint64>(0, len, tailIndex.loadAcquire() - head);
+    if(!skipped) return 0;
+
+    readOffset += skipped;
+
+    /* Move past fully consumed blocks. The producer doesn't write to them
+     * anymore once it has linked the next one.
+     */
+    bool movedBlock = false;
+    while(readOffset >= blockLength)
+    {
+        Block *next = readBlock->next.loadAcquire();
+        if(!next) break;
+
+        readBlock = next;
+        readOffset -= blockLength;
+        movedBlock = true;
+    }
+
+    /* Let the producer know it can reuse blocks we left behind */
+    if(movedBlock)
+        consumerBlock.storeRelease(readBlock);
+
+    headIndex.storeRelease(head + skipped);
+    return skipped;
+}
+
+QList<QByteArrayView> TAPIModemBuffer::peekSpans(qint64 maxlen) const
+{
+    QList<QByteArrayView> spans;
+
+    qint64 available = tailIndex.loadAcquire() - headIndex.loadRelaxed();
+    qint64 left = maxlen < 0 ? available : qMin(maxlen, available);
+    qint64 position = readOffset;
+    Block *block = readBlock;
+
+    /* Consumed block may still be the current one, if the next one isn't linked yet */
+    if(left > 0 && position == blockLength)
+    {
+        block = block->next.loadAcquire();
+        position = 0;
+    }
+
+    while(left > 0)
+    {
+        qint64 n = qMin(left, blockLength - position);
+        spans.append(QByteArrayView(block->data + position, n));
+        left -= n;
+        position = 0;
+        if(left > 0)
+            block = block->next.loadAcquire();
+    }
+
+    return spans;
+}
+
+QList<QByteArray> TAPIModemBuffer::readShared(qint64 maxlen)
+{
+    QList<QByteArray> chunks;
+
+    qint64 available = tailIndex.loadAcquire() - headIndex.loadRelaxed();
+    qint64 left = maxlen < 0 ? available : qMin(maxlen, available);
+    qint64 total = left;
+    qint64 position = readOffset;
+    Block *block = readBlock;
+
+    if(left > 0 && position == blockLength)
+    {
+        block = block->next.loadAcquire();
+        position = 0;
+    }
+
+    while(left > 0)
+    {
+        qint64 n = qMin(left, blockLength - position);
+
+        /* Whole blocks are finished by the producer, so we can just share them.
+         * Parts of blocks have to be copied.
+         */
+        if(position == 0 && n == blockLength)
+            chunks.append(block->storage);
+        else
+            chunks.append(QByteArray(block->data + position, n));
+
+        left -= n;
+        position = 0;
+        if(left > 0)
+            block = block->next.loadAcquire();
+    }
+
+    skip(total);
+    return chunks;
+}
+
+qint64 TAPIModemBuffer::indexOf(char c, qint64 from) const
+{
+    qint64 available = tailIndex.loadAcquire() - headIndex.loadRelaxed();
+    from = qMax<qint64>(0, from);
+    if(from >= available) return -1;
+
+    qint64 scanned = from;
+    qint64 position = readOffset + from;
+    Block *block = readBlock;
+
+    while(position >= blockLength)
+    {
+        position -= blockLength;
+        block = block->next.loadAcquire();
+    }
+
+    /* Scan block ranges until we find it or run out of data */
+    while(scanned < available)
+    {
+        qint64 n = qMin(available - scanned, blockLength - position);
+        qint64 index = findByte(block->data + position, n, c);
+        if(index >= 0)
+            return scanned + index;
+
+        scanned += n;
+        position = 0;
+        if(scanned < available)
+            block = block->next.loadAcquire();
+    }
+
+    return -1;
+}
+
+qint64 TAPIModemBuffer::indexOf(QByteArrayView delimiter, qint64 from) const
+{
+    if(delimiter.isEmpty()) return -1;
+    if(delimiter.size() == 1) return indexOf(delimiter.front(), from);
+
+    /* Last index the delimiter can still start at */
+    qint64 available = tailIndex.loadAcquire() - headIndex.loadRelaxed();
+    qint64 last = available - delimiter.size();
+    from = qMax<qint64>(0, from);
+    if(from > last) return -1;
+
+    qint64 scanned = from;
+    qint64 position = readOffset + from;
+    Block *block = readBlock;
+
+    while(position >= blockLength)
+    {
+        position -= blockLength;
+        block = block->next.loadAcquire();
+    }
+
+    /* Blocks are walked once. Every candidate for the first byte is compared in place,
+     * and the scan goes on from right after it in the same block.
+     */
+    while(scanned <= last)
+    {
+        qint64 n = qMin(last + 1 - scanned, blockLength - position);
+        qint64 index = findByte(block->data + position, n, delimiter.front());
+        if(index < 0)
+        {
+            scanned += n;
+            position = 0;
+            if(scanned <= last)
+                block = block->next.loadAcquire();
+            continue;
+        }
+
+        if(matchesAt(block, position + index, delimiter))
+            return scanned + index;
+
+        scanned += index + 1;
+        position += index + 1;
+        if(position == blockLength && scanned <= last)
+        {
+            block = block->next.loadAcquire();
+            position = 0;
+        }
+    }
+
+    return -1;
+}
+
+bool TAPIModemBuffer::matchesAt(const Block *block, qint64 position, QByteArrayView data) const
+{
+    /* Caller makes sure all of it is available, it may span the following blocks */
+    qint64 compared = 0;
+    while(compared < data.size())
+    {
+        if(position == blockLength)
+        {
+            block = block->next.loadAcquire();
+            position = 0;
+        }
+
+        qint64 n = qMin(data.size() - compared, blockLength - position);
+        if(memcmp(block->data + position, data.data() + compared, (size_t)n) != 0)
+            return false;
+
+        compared += n;
+        position += n;
+    }
+
+    return true;
+}
+
+void TAPIModemBuffer::clear()
+{
+    skip(size());
+}
+
+TAPIModemBuffer::Block *TAPIModemBuffer::nextWriteBlock()
+{
+    /* Check for blocks the consumer already left behind */
+    if(oldestBlock == knownConsumerBlock)
+        knownConsumerBlock = consumerBlock.loadAcquire();
+
+    /* Nothing to reuse, so the buffer has to grow */
+    if(oldestBlock == knownConsumerBlock)
+        return allocateBlock();
+
+    Block *block = oldestBlock;
+    oldestBlock = block->next.loadRelaxed();
+    block->next.storeRelaxed(nullptr);
+
+    /* Someone still holds this block from readShared(), so it gets a new storage */
+    if(!block->storage.isDetached())
+    {
+        block->storage = QByteArray(blockLength, Qt::Uninitialized);
+        block->data = block->storage.data();
+        allocations.storeRelaxed(allocations.loadRelaxed() + 1);
+    }
+
+    return block;
+}
+
+TAPIModemBuffer::Block *TAPIModemBuffer::allocateBlock()
+{
+    Block *block = new Block;
+    block->storage = QByteArray(blockLength, Qt::Uninitialized);
+    block->data = block->storage.data();
+    allocations.storeRelaxed(allocations.loadRelaxed() + 1);
+    return block;
+}
+
+TAPIModemRateEstimator::TAPIModemRateEstimator(qint64 windowMsecs) : slotLength(qMax<qint64>(windowMsecs / SlotCount, 1))
+{
+    reset();
+}
+
+void TAPIModemRateEstimator::addBytes(qint64 bytes, qint64 nowMsecs)
+{
+    qint64 slot = nowMsecs / slotLength;
+    int index = (int)(slot % SlotCount);
+
+    /* Slot is reused after the window moved past it */
+    if(slotNumber[index] != slot)
+    {
+        slotNumber[index] = slot;
+        slotBytes[index] = 0;
+    }
+    slotBytes[index] += bytes;
+
+    if(firstSlot < 0)
+        firstSlot = slot;
+}
+
+double TAPIModemRateEstimator::bytesPerSecond(qint64 nowMsecs) const
+{
+    if(firstSlot < 0) return 0;
+
+    qint64 slot = nowMsecs / slotLength;
+    qint64 oldestSlot = qMax(firstSlot, slot - SlotCount + 1);
+    qint64 total = 0;
+
+    for(int i = 0; i < SlotCount; i++)
+        if(slotNumber[i] >= oldestSlot && slotNumber[i] <= slot)
+            total += slotBytes[i];
+
+    /* Window starts with the oldest slot and ends now. A first burst counts as at least one slot long,
+     * otherwise a few bytes received a milisecond ago would look like a huge rate.
+     */
+    qint64 duration = qMax<qint64>(nowMsecs - oldestSlot * slotLength, slotLength);
+    return total * 1000.0 / duration;
+}
+
+void TAPIModemRateEstimator::reset()
+{
+    for(int i = 0; i < SlotCount; i++)
+    {
+        slotNumber[i] = -1;
+        slotBytes[i] = 0;
+    }
+    firstSlot = -1;
+}
@@ -0,0 +1,136 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Pieszka
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef QTTAPIMODEMBUFFER_H
+#define QTTAPIMODEMBUFFER_H
+
+#include "qttapimodem_global.h"
+
+#include <QAtomicInteger>
+#include <QAtomicPointer>
+#include <QList>
+#include <QByteArray>
+#include <QByteArrayView>
+
+/* Receive buffer for modem data
+ *
+ * Data is kept in a chain of fixed size blocks, so appending
+ * never moves already buffered bytes and consuming only moves
+ * the read position forward. Reads and peeks copy whole block
+ * ranges with memcpy instead of going byte by byte.
+ *
+ * The buffer is a single producer / single consumer queue. One
+ * thread may append() while another one reads, peeks or skips
+ * at the same time without any locking. Both sides publish their
+ * position as an atomic byte index (tail for the producer, head
+ * for the consumer) and size() is just the difference of both,
+ * so it can be checked from any thread.
+ *
+ * Blocks left behind by the consumer are recycled by the producer,
+ * so after the buffer has grown to its working size, receiving
+ * doesn't allocate anymore. Data can also be written in place with
+ * reserve() and commit(), which avoids any intermediate buffers.
+ *
+ * Consumer can also look at the data in place with peekSpans() and
+ * take it with readShared(), which hands over completely filled
+ * blocks as shared QByteArrays without copying them. Spans stay
+ * valid until the data they point to gets consumed. Shared blocks
+ * are never written to again, the producer replaces them with
+ * new ones when it finds them still in use.
+ *
+ * indexOf() looks for delimiters 16 or 32 bytes at a time with
+ * SSE2/AVX2 when the compiler targets them, byte by byte otherwise.
+ *
+ * The class lives in its own header without TAPI nor Win32, so
+ * it can be built and checked on any platform.
+ *
+ */
+class QTM_EXPORT TAPIModemBuffer
+{
+public:
+    explicit TAPIModemBuffer(qint64 blockSize = 4096);
+    ~TAPIModemBuffer();
+
+    qint64 size() const { return tailIndex.loadAcquire() - headIndex.loadAcquire(); }
+    bool isEmpty() const { return size() == 0; }
+    qint64 blockSize() const { return blockLength; }
+    qint64 allocationCount() const { return allocations.loadRelaxed(); }
+
+    /* Producer side */
+    void append(const char *data, qint64 len);
+    char *reserve(qint64 maxlen, qint64 *reserved);
+    void commit(qint64 len);
+
+    /* Consumer side */
+    qint64 read(char *data, qint64 maxlen);
+    qint64 peek(char *data, qint64 maxlen, qint64 offset = 0) const;
+    qint64 skip(qint64 len);
+    QList<QByteArrayView> peekSpans(qint64 maxlen = -1) const;
+    QList<QByteArray> readShared(qint64 maxlen = -1);
+    qint64 indexOf(char c, qint64 from = 0) const;
+    qint64 indexOf(QByteArrayView delimiter, qint64 from = 0) const;
+    void clear();
+
+private:
+    Q_DISABLE_COPY(TAPIModemBuffer)
+
+    struct Block
+    {
+        QByteArray storage;
+        char *data = nullptr;
+        QAtomicPointer<Block> next;
+    };
+
+    Block *allocateBlock();
+    Block *nextWriteBlock();
+    bool matchesAt(const Block *block, qint64 position, QByteArrayView data) const;
+
+    const qint64 blockLength;
+
+    /* Owned by the producer. Blocks from oldestBlock up to the consumer's block are free for reuse */
+    Block *writeBlock = nullptr;
+    qint64 writeOffset = 0;
+    Block *oldestBlock = nullptr;
+    Block *knownConsumerBlock = nullptr;
+    /* Block storages allocated since creation, new blocks and replaced shared ones */
+    QAtomicInteger<qint64> allocations = 0;
+
+    /* Owned by the consumer */
+    Block *readBlock = nullptr;
+    qint64 readOffset = 0;
+    QAtomicPointer<Block> consumerBlock;
+
+    /* Total bytes appended and consumed since creation */
+    QAtomicInteger<qint64> tailIndex = 0;
+    QAtomicInteger<qint64> headIndex = 0;
+};
+
+/* Sliding window byte rate estimator
+ *
+ * Bytes are counted in fixed time slots and the rate is the sum
+ * of slots inside the window divided by its length. Time is given
+ * by the caller in miliseconds, so the class doesn't need any clock
+ * on its own and can be driven by a simulated one.
+ *
+ */
+class QTM_EXPORT TAPIModemRateEstimator
+{
+public:
+    explicit TAPIModemRateEstimator(qint64 windowMsecs = 1000);
+
+    void addBytes(qint64 bytes, qint64 nowMsecs);
+    double bytesPerSecond(qint64 nowMsecs) const;
+    void reset();
+
+private:
+    static constexpr int SlotCount = 20;
+
+    qint64 slotLength;
+    qint64 slotNumber[SlotCount];
+    qint64 slotBytes[SlotCount];
+    qint64 firstSlot = -1;
+};
+
+#endif // QTTAPIMODEMBUFFER_H
@@ -0,0 +1,580 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Pieszka
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <QtTest>
+
+#include "qttapimodembuffer.h"
+
+/* Bytes that tell their own position, so misplaced data is easy to spot */
+static QByteArray pattern(qint64 from, qint64 len)
+{
+    QByteArray data(len, Qt::Uninitialized);
+    for(qint64 i = 0; i < len; i++)
+        data[i] = (char)((from + i) % 251);
+    return data;
+}
+
+/* Receive path the buffer replaced: one QByteArray, copied out byte by byte and
+ * shifted with remove() after every read, counted by a semaphore
+ */
+class OldReceiveBuffer
+{
+public:
+    void append(const char *data, qint64 len)
+    {
+        mutex.lock();
+        buffer.append(data, len);
+        mutex.unlock();
+        semaphore.release((int)len);
+    }
+
+    qint64 read(char *data, qint64 maxlen)
+    {
+        QMutexLocker locker(&mutex);
+        qint64 n = qMin(maxlen, (qint64)buffer.size());
+        if(!n || !semaphore.tryAcquire((int)n))
+            return 0;
+        for(qint64 i = 0; i < n; i++)
+            data[i] = buffer.at(i);
+        buffer.remove(0, n);
+        return n;
+    }
+
+    qint64 size() const { return semaphore.available(); }
+
+private:
+    QByteArray buffer;
+    QMutex mutex;
+    QSemaphore semaphore;
+};
+
+/* Sequential device without readLineData(), so readLine() takes QIODevice's generic path like TAPIModem used to */
+class SequentialDevice : public QIODevice
+{
+public:
+    explicit SequentialDevice(const QByteArray &data) : source(data) { open(QIODevice::ReadOnly); }
+    bool isSequential() const override { return true; }
+    qint64 bytesAvailable() const override { return source.size() - position + QIODevice::bytesAvailable(); }
+
+protected:
+    qint64 readData(char *data, qint64 maxlen) override
+    {
+        qint64 n = qMin(maxlen, source.size() - position);
+        memcpy(data, source.constData() + position, (size_t)n);
+        position += n;
+        return n;
+    }
+    qint64 writeData(const char *, qint64) override { return -1; }
+
+private:
+    QByteArray source;
+    qint64 position = 0;
+};
+
+/* Lines of varying length, like modem responses and records */
+static QByteArray lines(int count)
+{
+    QByteArray data;
+    for(int i = 0; i < count; i++)
+    {
+        data.append(QByteArray(8 + (i * 13) % 120, 'a' + i % 26));
+        data.append("\r\n");
+    }
+    return data;
+}
+
+class tst_TAPIModemBuffer : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void appendAndRead();
+    void reserveAndCommit();
+    void peekWithOffset();
+    void skip();
+    void indexOfAcrossBlocks();
+    void peekSpans();
+    void readSharedKeepsBlocks();
+    void clear();
+    void steadyStateDoesNotAllocate();
+    void sharedBlocksAreReplaced();
+    void producerConsumerStress();
+    void rateEstimator();
+
+    /* Benchmarks */
+    void smallReads();
+    void smallReadsOld();
+    void threadedThroughput();
+    void threadedThroughputOld();
+    void readLines();
+    void readLinesQIODevice();
+};
+
+void tst_TAPIModemBuffer::appendAndRead()
+{
+    TAPIModemBuffer buffer(64);
+    QByteArray data = pattern(0, 1000);
+
+    buffer.append(data.constData(), 300);
+    buffer.append(data.constData() + 300, 700);
+    QCOMPARE(buffer.size(), 1000);
+
+    QByteArray out(1000, Qt::Uninitialized);
+    QCOMPARE(buffer.read(out.data(), 10), 10);
+    QCOMPARE(buffer.read(out.data() + 10, 2000), 990);
+    QCOMPARE(out, data);
+    QVERIFY(buffer.isEmpty());
+    QCOMPARE(buffer.read(out.data(), 10), 0);
+}
+
+void tst_TAPIModemBuffer::reserveAndCommit()
+{
+    TAPIModemBuffer buffer(64);
+
+    /* Space never goes past the current block */
+    qint64 reserved = 0;
+    char *space = buffer.reserve(100, &reserved);
+    QCOMPARE(reserved, 64);
+    memcpy(space, "abc", 3);
+    buffer.commit(3);
+
+    space = buffer.reserve(100, &reserved);
+    QCOMPARE(reserved, 61);
+    memcpy(space, "def", 3);
+    buffer.commit(3);
+
+    QByteArray out(6, Qt::Uninitialized);
+    QCOMPARE(buffer.read(out.data(), out.size()), 6);
+    QCOMPARE(out, QByteArray("abcdef"));
+}
+
+void tst_TAPIModemBuffer::peekWithOffset()
+{
+    TAPIModemBuffer buffer(64);
+    QByteArray data = pattern(0, 200);
+    buffer.append(data.constData(), data.size());
+
+    QByteArray out(100, Qt::Uninitialized);
+    QCOMPARE(buffer.peek(out.data(), 100, 50), 100);
+    QCOMPARE(out, data.mid(50, 100));
+    QCOMPARE(buffer.peek(out.data(), 100, 150), 50);
+    QCOMPARE(buffer.peek(out.data(), 100, 200), 0);
+    QCOMPARE(buffer.size(), 200);
+}
+
+void tst_TAPIModemBuffer::skip()
+{
+    TAPIModemBuffer buffer(64);
+    QByteArray data = pattern(0, 200);
+    buffer.append(data.constData(), data.size());
+
+    QCOMPARE(buffer.skip(130), 130);
+    QCOMPARE(buffer.skip(500), 70);
+    QVERIFY(buffer.isEmpty());
+
+    /* Blocks left behind are reused and the data still comes out right */
+    buffer.append(data.constData(), data.size());
+    QByteArray out(200, Qt::Uninitialized);
+    QCOMPARE(buffer.read(out.data(), out.size()), 200);
+    QCOMPARE(out, data);
+}
+
+void tst_TAPIModemBuffer::indexOfAcrossBlocks()
+{
+    TAPIModemBuffer buffer(64);
+    QByteArray data(200, 'x');
+    data[62] = '\r';
+    data[63] = '\n';
+    data[127] = '\r';
+    data[128] = '\n';
+    buffer.append(data.constData(), data.size());
+
+    QCOMPARE(buffer.indexOf('\n'), 63);
+    QCOMPARE(buffer.indexOf('\n', 64), 128);
+    QCOMPARE(buffer.indexOf('z'), -1);
+    QCOMPARE(buffer.indexOf(QByteArrayView("\r\n")), 62);
+    QCOMPARE(buffer.indexOf(QByteArrayView("\r\n"), 63), 127);
+    QCOMPARE(buffer.indexOf(QByteArrayView("\r\nx\r")), -1);
+    QCOMPARE(buffer.indexOf(QByteArrayView("xx"), 198), 198);
+    QCOMPARE(buffer.indexOf(QByteArrayView("xxx"), 198), -1);
+
+    /* Longer than a block, after a lot of false candidates */
+    QCOMPARE(buffer.indexOf(QByteArrayView(QByteArray(70, 'x'))), 129);
+}
+
+void tst_TAPIModemBuffer::peekSpans()
+{
+    TAPIModemBuffer buffer(64);
+    QByteArray data = pattern(0, 150);
+    buffer.append(data.constData(), data.size());
+    buffer.skip(10);
+
+    QList<QByteArrayView> spans = buffer.peekSpans();
+    QCOMPARE(spans.size(), 3);
+    QCOMPARE(spans.at(0).size(), 54);
+
+    QByteArray joined;
+    for(const QByteArrayView &span : std::as_const(spans))
+        joined.append(span);
+    QCOMPARE(joined, data.mid(10));
+
+    QCOMPARE(buffer.peekSpans(20).size(), 1);
+    QCOMPARE(buffer.size(), 140);
+}
+
+void tst_TAPIModemBuffer::readSharedKeepsBlocks()
+{
+    TAPIModemBuffer buffer(64);
+    QByteArray data = pattern(0, 160);
+    buffer.append(data.constData(), data.size());
+
+    QList<QByteArray> chunks = buffer.readShared();
+    QVERIFY(buffer.isEmpty());
+    QCOMPARE(chunks.join(), data);
+
+    /* Shared blocks must not be overwritten when the buffer wraps around */
+    QByteArray more = pattern(1000, 500);
+    buffer.append(more.constData(), more.size());
+    QCOMPARE(chunks.join(), data);
+
+    QByteArray out(500, Qt::Uninitialized);
+    QCOMPARE(buffer.read(out.data(), out.size()), 500);
+    QCOMPARE(out, more);
+}
+
+void tst_TAPIModemBuffer::clear()
+{
+    TAPIModemBuffer buffer(64);
+    QByteArray data = pattern(0, 100);
+    buffer.append(data.constData(), data.size());
+    buffer.clear();
+    QVERIFY(buffer.isEmpty());
+
+    buffer.append("z", 1);
+    QCOMPARE(buffer.indexOf('z'), 0);
+}
+
+void tst_TAPIModemBuffer::steadyStateDoesNotAllocate()
+{
+    TAPIModemBuffer buffer(64);
+    QByteArray out(1000, Qt::Uninitialized);
+
+    /* Receive like the modem does, straight into reserved space, up to the working size */
+    auto receive = [&buffer](qint64 len)
+    {
+        while(len > 0)
+        {
+            qint64 reserved = 0;
+            char *space = buffer.reserve(len, &reserved);
+            memset(space, 'x', (size_t)reserved);
+            buffer.commit(reserved);
+            len -= reserved;
+        }
+    };
+
+    for(int i = 0; i < 10; i++)
+    {
+        receive(1000);
+        QCOMPARE(buffer.read(out.data(), out.size()), 1000);
+    }
+    qint64 warm = buffer.allocationCount();
+    QVERIFY(warm > 0);
+
+    /* Bursts of the same size only reuse the blocks left behind */
+    for(int i = 0; i < 1000; i++)
+    {
+        receive(1 + i % 1000);
+        QCOMPARE(buffer.read(out.data(), out.size()), 1 + i % 1000);
+    }
+    QCOMPARE(buffer.allocationCount(), warm);
+}
+
+void tst_TAPIModemBuffer::sharedBlocksAreReplaced()
+{
+    TAPIModemBuffer buffer(64);
+    QByteArray data = pattern(0, 256);
+
+    for(int i = 0; i < 10; i++)
+    {
+        buffer.append(data.constData(), data.size());
+        buffer.readShared();
+    }
+    qint64 warm = buffer.allocationCount();
+
+    /* Dropped chunks are recycled in place */
+    for(int i = 0; i < 100; i++)
+    {
+        buffer.append(data.constData(), data.size());
+        buffer.readShared();
+    }
+    QCOMPARE(buffer.allocationCount(), warm);
+
+    /* Held ones get a new storage when their block comes around again */
+    QList<QByteArray> held = buffer.readShared();
+    buffer.append(data.constData(), data.size());
+    held = buffer.readShared();
+    buffer.append(data.constData(), data.size());
+    QVERIFY(buffer.allocationCount() > warm);
+    QCOMPARE(held.join(), data);
+}
+
+void tst_TAPIModemBuffer::producerConsumerStress()
+{
+    static constexpr qint64 Total = 8 * 1024 * 1024;
+
+    /* Small blocks, so blocks are linked and recycled all the time */
+    TAPIModemBuffer buffer(64);
+    QAtomicInt stop = 0;
+
+    QThread *producer = QThread::create([&buffer, &stop]() {
+        qint64 produced = 0;
+        int round = 0;
+        while(produced < Total)
+        {
+            /* Sizes from 1 byte to a few blocks, both copied and written in place */
+            qint64 len = qMin<qint64>(Total - produced, 1 + (round * 37) % 300);
+            if(round % 2)
+            {
+                QByteArray data = pattern(produced, len);
+                buffer.append(data.constData(), len);
+            }
+            else
+            {
+                qint64 reserved = 0;
+                char *space = buffer.reserve(len, &reserved);
+                QByteArray data = pattern(produced, reserved);
+                memcpy(space, data.constData(), (size_t)reserved);
+                buffer.commit(reserved);
+                len = reserved;
+            }
+            produced += len;
+            round++;
+
+            /* Don't run too far ahead of the consumer */
+            while(buffer.size() > 64 * 1024)
+            {
+                if(stop.loadRelaxed()) return;
+                QThread::yieldCurrentThread();
+            }
+        }
+    });
+    producer->start();
+
+    qint64 consumed = 0;
+    int round = 0;
+    bool ordered = true;
+    QList<QByteArray> held;
+    QList<qint64> heldFrom;
+    QByteArray out(512, Qt::Uninitialized);
+
+    while(consumed < Total && ordered)
+    {
+        qint64 available = buffer.size();
+        if(available == 0)
+        {
+            QThread::yieldCurrentThread();
+            continue;
+        }
+
+        switch(round++ % 4)
+        {
+        case 0:
+        {
+            qint64 n = buffer.read(out.data(), qMin<qint64>(available, 1 + round % out.size()));
+            ordered = out.left(n) == pattern(consumed, n);
+            consumed += n;
+            break;
+        }
+        case 1:
+        {
+            qint64 n = buffer.peek(out.data(), out.size());
+            ordered = out.left(n) == pattern(consumed, n);
+            consumed += buffer.skip(n);
+            break;
+        }
+        case 2:
+        {
+            /* Hold on to shared blocks for a while, so the producer has to detach them */
+            for(const QByteArray &chunk : buffer.readShared(qMin<qint64>(available, 1000)))
+            {
+                ordered = ordered && chunk == pattern(consumed, chunk.size());
+                held.append(chunk);
+                heldFrom.append(consumed);
+                consumed += chunk.size();
+            }
+            if(held.size() > 64)
+            {
+                for(qsizetype i = 0; i < held.size(); i++)
+                    ordered = ordered && held.at(i) == pattern(heldFrom.at(i), held.at(i).size());
+                held.clear();
+                heldFrom.clear();
+            }
+            break;
+        }
+        case 3:
+        {
+            qint64 n = 0;
+            for(const QByteArrayView &span : buffer.peekSpans(700))
+            {
+                ordered = ordered && span == pattern(consumed + n, span.size());
+                n += span.size();
+            }
+            consumed += buffer.skip(n);
+            break;
+        }
+        }
+    }
+
+    stop.storeRelaxed(1);
+    producer->wait();
+    delete producer;
+
+    QVERIFY2(ordered, qPrintable(QString("Data out of order at byte %1").arg(consumed)));
+    for(qsizetype i = 0; i < held.size(); i++)
+        QCOMPARE(held.at(i), pattern(heldFrom.at(i), held.at(i).size()));
+    QCOMPARE(consumed, Total);
+    QVERIFY(buffer.isEmpty());
+}
+
+void tst_TAPIModemBuffer::rateEstimator()
+{
+    TAPIModemRateEstimator estimator(1000);
+    QCOMPARE(estimator.bytesPerSecond(0), 0.0);
+
+    /* Steady 100 bytes every 50 ms is 2000 bytes per second */
+    for(qint64 now = 0; now < 3000; now += 50)
+        estimator.addBytes(100, now);
+    QVERIFY(qAbs(estimator.bytesPerSecond(3000) - 2000.0) < 200.0);
+
+    /* Old data falls out of the window */
+    QCOMPARE(estimator.bytesPerSecond(10000), 0.0);
+
+    estimator.reset();
+    QCOMPARE(estimator.bytesPerSecond(10000), 0.0);
+
+    /* A first burst is spread over at least one slot (50 ms) */
+    estimator.addBytes(100, 20001);
+    QCOMPARE(estimator.bytesPerSecond(20001), 2000.0);
+    QCOMPARE(estimator.bytesPerSecond(20002), 2000.0);
+    QCOMPARE(estimator.bytesPerSecond(20100), 1000.0);
+}
+
+/* Burst of 64 KiB taken in 16 byte pieces */
+void tst_TAPIModemBuffer::smallReads()
+{
+    QByteArray data = pattern(0, 64 * 1024);
+    char out[16];
+    TAPIModemBuffer buffer;
+
+    QBENCHMARK
+    {
+        buffer.append(data.constData(), data.size());
+        while(buffer.read(out, sizeof(out)) > 0) {}
+    }
+}
+
+void tst_TAPIModemBuffer::smallReadsOld()
+{
+    QByteArray data = pattern(0, 64 * 1024);
+    char out[16];
+    OldReceiveBuffer buffer;
+
+    QBENCHMARK
+    {
+        buffer.append(data.constData(), data.size());
+        while(buffer.read(out, sizeof(out)) > 0) {}
+    }
+}
+
+/* 4 MiB passed from a producer thread in 1500 byte events to a consumer reading 512 bytes at a time */
+template <typename Buffer>
+static void transfer(Buffer &buffer)
+{
+    static constexpr qint64 Total = 4 * 1024 * 1024;
+    QByteArray data = pattern(0, 1500);
+
+    QThread *producer = QThread::create([&buffer, &data]() {
+        for(qint64 produced = 0; produced < Total; produced += data.size())
+        {
+            buffer.append(data.constData(), qMin<qint64>(data.size(), Total - produced));
+            while(buffer.size() > 256 * 1024)
+                QThread::yieldCurrentThread();
+        }
+    });
+    producer->start();
+
+    char out[512];
+    qint64 consumed = 0;
+    while(consumed < Total)
+    {
+        qint64 n = buffer.read(out, sizeof(out));
+        if(n == 0)
+            QThread::yieldCurrentThread();
+        consumed += n;
+    }
+
+    producer->wait();
+    delete producer;
+}
+
+void tst_TAPIModemBuffer::threadedThroughput()
+{
+    QBENCHMARK
+    {
+        TAPIModemBuffer buffer;
+        transfer(buffer);
+    }
+}
+
+void tst_TAPIModemBuffer::threadedThroughputOld()
+{
+    QBENCHMARK
+    {
+        OldReceiveBuffer buffer;
+        transfer(buffer);
+    }
+}
+
+/* Line by line, delimiter found by the SIMD scan */
+void tst_TAPIModemBuffer::readLines()
+{
+    QByteArray data = lines(2000);
+    QByteArray line(256, Qt::Uninitialized);
+    TAPIModemBuffer buffer;
+    int count = 0;
+
+    QBENCHMARK
+    {
+        count = 0;
+        buffer.append(data.constData(), data.size());
+        qint64 index;
+        while((index = buffer.indexOf(QByteArrayView("\r\n"))) >= 0)
+        {
+            buffer.read(line.data(), index + 2);
+            count++;
+        }
+    }
+    QCOMPARE(count, 2000);
+}
+
+void tst_TAPIModemBuffer::readLinesQIODevice()
+{
+    QByteArray data = lines(2000);
+    QByteArray line(256, Qt::Uninitialized);
+    int count = 0;
+
+    QBENCHMARK
+    {
+        count = 0;
+        SequentialDevice device(data);
+        while(device.readLine(line.data(), line.size()) > 0)
+            count++;
+    }
+    QCOMPARE(count, 2000);
+}
+
+QTEST_APPLESS_MAIN(tst_TAPIModemBuffer)
+
+#include "tst_tapimodembuffer.moc"